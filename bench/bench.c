@@ -0,0 +1,561 @@
+/* Throughput benchmarks for the puts & gets, over each transport.
+ *
+ * Each case serializes (or deserializes) a stream of about `size' bytes of
+ * one kind of field, or of mixed records, and is repeated for at least the
+ * minimum time; the fastest of a few such runs is reported. Results are
+ * tab-separated, one line per case, with the first four columns as the key:
+ *
+ *     case  op  transport  size  bytes  fields  MB/s  ns/field
+ *
+ * so that two runs can be compared with bench/compare.
+ *
+ * Usage: bench [-t SECONDS] [-s SIZE]... [-x TRANSPORT]... [SUBSTRING...]
+ *
+ * -t sets the minimum time per run (default 0.05s); -s and -x restrict the
+ * stream sizes and transports (memory, file, fd); and if there are any
+ * SUBSTRINGs, only cases whose names contain one of them are run.
+ */
+
+/* For clock_gettime & fileno. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <slz.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NRUNS 3
+/* The values we put come from tables of this many entries. */
+#define NVALS 65536
+#define VAL_MASK (NVALS - 1)
+/* Array puts & gets go this many values at a time. */
+#define BATCH 1024
+
+static uint64_t vals[NVALS];
+static uint16_t vals16[NVALS];
+static uint32_t vals32[NVALS], small32[NVALS];
+static uint64_t vals64[NVALS];
+static char text[NVALS + 4096];
+
+/* The numeric fields of the records below, for the columnar cases. */
+typedef struct {
+    uint32_t id, flag;
+    int64_t time;
+    int32_t delta;
+} row_t;
+
+static row_t rows[NVALS];
+
+/* What the gets add up to, so that they aren't optimized away. */
+static volatile uint64_t sink_hole;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void init_vals(void)
+{
+    uint64_t x = 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < NVALS; ++i) {
+        /* xorshift64 */
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        vals[i] = x;
+        vals16[i] = (uint16_t) x;
+        vals32[i] = (uint32_t) x;
+        vals64[i] = x;
+        /* Mostly small, as lengths & counts tend to be. */
+        small32[i] = (uint32_t) (x >> 32) >> (x & 31);
+    }
+    for (size_t i = 0; i < sizeof text; ++i)
+        text[i] = (char) ('a' + vals[i & VAL_MASK] % 26);
+    for (size_t i = 0; i < NVALS; ++i) {
+        rows[i].id = (uint32_t) i;
+        rows[i].flag = vals[i] & 1;
+        rows[i].time = (int64_t) (1500000000000 + 7 * i);
+        rows[i].delta = (int32_t) (vals[i] % 2001) - 1000;
+    }
+}
+
+
+/* Cases. Each puts or gets `n' fields. */
+typedef struct {
+    const char *name;
+    size_t width;               /* roughly, bytes per field */
+    void (*put)(slz_ctx_t *ctx, slz_sink_t *sink, size_t n);
+    void (*get)(slz_ctx_t *ctx, slz_src_t *src, size_t n);
+} bench_case_t;
+
+#define DEFINE_SCALAR(name, type, expr)                                 \
+    static void put_##name(slz_ctx_t *ctx, slz_sink_t *sink, size_t n)  \
+    {                                                                   \
+        for (size_t i = 0; i < n; ++i)                                  \
+            slz_put_##name(ctx, sink, (type) (expr));                   \
+    }                                                                   \
+    static void get_##name(slz_ctx_t *ctx, slz_src_t *src, size_t n)    \
+    {                                                                   \
+        uint64_t sum = 0;                                               \
+        for (size_t i = 0; i < n; ++i)                                  \
+            sum += (uint64_t) slz_get_##name(ctx, src);                 \
+        sink_hole += sum;                                               \
+    }
+
+DEFINE_SCALAR(bool, bool, vals[i & VAL_MASK] & 1)
+DEFINE_SCALAR(uint8, uint8_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(int8, int8_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(uint16, uint16_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(int16, int16_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(uint32, uint32_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(int32, int32_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(uint64, uint64_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(int64, int64_t, vals[i & VAL_MASK])
+DEFINE_SCALAR(varuint, uint64_t, small32[i & VAL_MASK])
+DEFINE_SCALAR(varint, int64_t, (int32_t) small32[i & VAL_MASK] - 1000)
+#undef DEFINE_SCALAR
+
+/* Full-width varuints, mostly 9 or 10 bytes long. */
+static void put_varuint_wide(slz_ctx_t *ctx, slz_sink_t *sink, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        slz_put_varuint(ctx, sink, vals[i & VAL_MASK]);
+}
+
+static void get_varuint_wide(slz_ctx_t *ctx, slz_src_t *src, size_t n) {
+    get_varuint(ctx, src, n);
+}
+
+#define DEFINE_ARRAY(name, type, table)                                 \
+    static void put_##name##_array(                                     \
+        slz_ctx_t *ctx, slz_sink_t *sink, size_t n)                     \
+    {                                                                   \
+        for (size_t i = 0; i < n; i += BATCH) {                         \
+            size_t len = n - i < BATCH ? n - i : BATCH;                 \
+            slz_put_##name##_array(                                     \
+                ctx, sink, len, (const type*) table + (i & VAL_MASK));  \
+        }                                                               \
+    }                                                                   \
+    static void get_##name##_array(                                     \
+        slz_ctx_t *ctx, slz_src_t *src, size_t n)                       \
+    {                                                                   \
+        type out[BATCH];                                                \
+        uint64_t sum = 0;                                               \
+        for (size_t i = 0; i < n; i += BATCH) {                         \
+            size_t len = n - i < BATCH ? n - i : BATCH;                 \
+            slz_get_##name##_array(ctx, src, len, out);                 \
+            sum += (uint64_t) out[0] + (uint64_t) out[len - 1];         \
+        }                                                               \
+        sink_hole += sum;                                               \
+    }
+
+/* NVALS is a multiple of BATCH, so batches never run off the tables. */
+DEFINE_ARRAY(uint16, uint16_t, vals16)
+DEFINE_ARRAY(int16, int16_t, vals16)
+DEFINE_ARRAY(uint32, uint32_t, vals32)
+DEFINE_ARRAY(int32, int32_t, vals32)
+DEFINE_ARRAY(uint64, uint64_t, vals64)
+DEFINE_ARRAY(int64, int64_t, vals64)
+DEFINE_ARRAY(varuint32, uint32_t, small32)
+DEFINE_ARRAY(varint32, int32_t, small32)
+#undef DEFINE_ARRAY
+
+/* Blobs of a fixed length. */
+#define DEFINE_BLOB(len)                                                \
+    static void put_blob##len(slz_ctx_t *ctx, slz_sink_t *sink, size_t n) \
+    {                                                                   \
+        for (size_t i = 0; i < n; ++i)                                  \
+            slz_put_blob(ctx, sink, len, text + (i & 4095));            \
+    }                                                                   \
+    static void get_blob##len(slz_ctx_t *ctx, slz_src_t *src, size_t n) \
+    {                                                                   \
+        slz_arena_t arena;                                              \
+        slz_arena_init(&arena, 0);                                      \
+        uint64_t sum = 0;                                               \
+        for (size_t i = 0; i < n; ++i) {                                \
+            sum += (unsigned char)                                      \
+                *slz_get_blob_arena(ctx, src, &arena, NULL);            \
+            if (i % BATCH == BATCH - 1)                                 \
+                slz_arena_reset(&arena);                                \
+        }                                                               \
+        slz_arena_free(&arena);                                         \
+        sink_hole += sum;                                               \
+    }
+
+DEFINE_BLOB(16)
+DEFINE_BLOB(256)
+DEFINE_BLOB(4096)
+#undef DEFINE_BLOB
+
+/* Short names from a vocabulary of NNAMES, as blobs and interned. */
+#define NNAMES 256
+#define NAME(i) (text + 16 * (vals[(i) & VAL_MASK] % NNAMES))
+#define NAME_LEN(i) (8 + vals[(i) & VAL_MASK] % NNAMES % 17)
+
+static void put_names(slz_ctx_t *ctx, slz_sink_t *sink, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        slz_put_blob(ctx, sink, NAME_LEN(i), NAME(i));
+}
+
+#define get_names get_blob16
+
+static void put_names_interned(slz_ctx_t *ctx, slz_sink_t *sink, size_t n)
+{
+    slz_intern_t intern;
+    slz_intern_init(&intern, 0, 0);
+    slz_sink_set_intern(sink, &intern);
+    for (size_t i = 0; i < n; ++i)
+        slz_put_blob_interned(ctx, sink, NAME_LEN(i), NAME(i));
+    slz_sink_set_intern(sink, NULL);
+    slz_intern_free(&intern);
+}
+
+static void get_names_interned(slz_ctx_t *ctx, slz_src_t *src, size_t n)
+{
+    slz_intern_t intern;
+    slz_intern_init(&intern, 0, 0);
+    slz_src_set_intern(src, &intern);
+    slz_arena_t arena;
+    slz_arena_init(&arena, 0);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += (unsigned char) *slz_get_str_interned(ctx, src, &arena, NULL);
+    slz_arena_free(&arena);
+    slz_intern_free(&intern);
+    sink_hole += sum;
+}
+
+/* Mixed records, of the sort a log or event stream might hold: an id, a
+ * timestamp, a small signed delta, a flag, a short name and four counters.
+ * Each counts as one field. */
+static void put_record(slz_ctx_t *ctx, slz_sink_t *sink, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t v = vals[i & VAL_MASK];
+        slz_put_uint32(ctx, sink, (uint32_t) i);
+        slz_put_int64(ctx, sink, (int64_t) (1500000000000 + 7 * i));
+        slz_put_varint(ctx, sink, (int64_t) (v % 2001) - 1000);
+        slz_put_bool(ctx, sink, v & 1);
+        slz_put_blob(ctx, sink, 8 + (v >> 8) % 17, text + (i & 4095));
+        slz_put_uint16_array(ctx, sink, 4, vals16 + (i & (VAL_MASK - 3)));
+    }
+}
+
+static void get_record(slz_ctx_t *ctx, slz_src_t *src, size_t n)
+{
+    slz_arena_t arena;
+    slz_arena_init(&arena, 0);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint16_t counters[4];
+        size_t len;
+        sum += slz_get_uint32(ctx, src);
+        sum += (uint64_t) slz_get_int64(ctx, src);
+        sum += (uint64_t) slz_get_varint(ctx, src);
+        sum += slz_get_bool(ctx, src);
+        slz_get_blob_arena(ctx, src, &arena, &len);
+        sum += len;
+        slz_get_uint16_array(ctx, src, 4, counters);
+        sum += counters[3];
+        if (i % BATCH == BATCH - 1)
+            slz_arena_reset(&arena);
+    }
+    slz_arena_free(&arena);
+    sink_hole += sum;
+}
+
+/* The same records' numeric fields as a record batch per BATCH rows, each
+ * value counting as a field; and a scan of just the timestamps, skipping the
+ * other columns. */
+#define NCOLUMNS 4
+
+static void put_columns(slz_ctx_t *ctx, slz_sink_t *sink, size_t n)
+{
+    for (size_t i = 0; i < n; i += NCOLUMNS * BATCH) {
+        size_t len = n - i < NCOLUMNS * BATCH ?
+            (n - i + NCOLUMNS - 1) / NCOLUMNS : BATCH;
+        const row_t *r = rows + (i / NCOLUMNS & VAL_MASK);
+        slz_put_batch(ctx, sink, len, NCOLUMNS);
+        slz_put_column_uint32(ctx, sink, len, &r->id, sizeof *r);
+        slz_put_column_int64(ctx, sink, len, &r->time, sizeof *r);
+        slz_put_column_int32(ctx, sink, len, &r->delta, sizeof *r);
+        slz_put_column_uint32(ctx, sink, len, &r->flag, sizeof *r);
+    }
+}
+
+static void get_columns(slz_ctx_t *ctx, slz_src_t *src, size_t n)
+{
+    row_t out[BATCH];
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i += NCOLUMNS * BATCH) {
+        size_t len = (size_t) slz_get_batch(ctx, src).nrows;
+        slz_get_column_uint32(ctx, src, len, &out->id, sizeof *out);
+        slz_get_column_int64(ctx, src, len, &out->time, sizeof *out);
+        slz_get_column_int32(ctx, src, len, &out->delta, sizeof *out);
+        slz_get_column_uint32(ctx, src, len, &out->flag, sizeof *out);
+        sum += out[len - 1].id + (uint64_t) out[len - 1].time +
+            (uint64_t) out[len - 1].delta + out[len - 1].flag;
+    }
+    sink_hole += sum;
+}
+
+#define put_columns_scan put_columns
+
+static void get_columns_scan(slz_ctx_t *ctx, slz_src_t *src, size_t n)
+{
+    int64_t times[BATCH];
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i += NCOLUMNS * BATCH) {
+        size_t len = (size_t) slz_get_batch(ctx, src).nrows;
+        slz_skip_column(ctx, src, len);
+        slz_get_column_int64(ctx, src, len, times, sizeof *times);
+        slz_skip_column(ctx, src, len);
+        slz_skip_column(ctx, src, len);
+        sum += (uint64_t) times[len - 1];
+    }
+    sink_hole += sum;
+}
+
+#define CASE(name, width) { #name, width, put_##name, get_##name }
+static const bench_case_t cases[] = {
+    CASE(bool, 1),
+    CASE(uint8, 1),
+    CASE(int8, 1),
+    CASE(uint16, 2),
+    CASE(int16, 2),
+    CASE(uint32, 4),
+    CASE(int32, 4),
+    CASE(uint64, 8),
+    CASE(int64, 8),
+    CASE(varuint, 3),
+    CASE(varuint_wide, 10),
+    CASE(varint, 3),
+    CASE(uint16_array, 2),
+    CASE(int16_array, 2),
+    CASE(uint32_array, 4),
+    CASE(int32_array, 4),
+    CASE(uint64_array, 8),
+    CASE(int64_array, 8),
+    CASE(varuint32_array, 3),
+    CASE(varint32_array, 3),
+    CASE(blob16, 17),
+    CASE(blob256, 258),
+    CASE(blob4096, 4098),
+    CASE(names, 17),
+    CASE(names_interned, 17),
+    CASE(record, 40),
+    CASE(columns, 1),
+    CASE(columns_scan, 1),
+};
+#undef CASE
+#define NCASES (sizeof cases / sizeof *cases)
+
+
+/* Transports. Puts go to a scratch file (or memory), which gets then read
+ * back; the data to get is written once per case. */
+enum transport { MEMORY, FILE_, FD, NTRANSPORTS };
+static const char *transport_names[NTRANSPORTS] = { "memory", "file", "fd" };
+
+typedef struct {
+    enum transport transport;
+    FILE *file;                 /* scratch file for FILE_ & FD */
+    char *mem;                  /* what was put, for MEMORY */
+    size_t len;                 /* bytes put */
+} bench_io_t;
+
+static void open_sink(slz_ctx_t *ctx, bench_io_t *io, slz_sink_t *sink)
+{
+    switch (io->transport) {
+    case MEMORY:
+        slz_sink_to_memory(ctx, sink);
+        break;
+    case FILE_:
+        rewind(io->file);
+        slz_sink_from_file(ctx, sink, io->file);
+        break;
+    case FD:
+        lseek(fileno(io->file), 0, SEEK_SET);
+        slz_sink_from_fd(ctx, sink, fileno(io->file), 0);
+        break;
+    default:
+        abort();
+    }
+}
+
+static void close_sink(slz_ctx_t *ctx, bench_io_t *io, slz_sink_t *sink)
+{
+    slz_sink_flush(ctx, sink);
+    if (io->transport == MEMORY) {
+        free(io->mem);
+        io->mem = slz_sink_memory_release(ctx, sink, &io->len);
+    }
+    else if (io->transport == FILE_)
+        io->len = (size_t) ftell(io->file);
+    else
+        io->len = (size_t) lseek(fileno(io->file), 0, SEEK_CUR);
+    slz_sink_destroy(ctx, sink);
+}
+
+static void open_src(slz_ctx_t *ctx, bench_io_t *io, slz_src_t *src)
+{
+    switch (io->transport) {
+    case MEMORY:
+        slz_src_from_memory(ctx, src, io->mem, io->len);
+        break;
+    case FILE_:
+        rewind(io->file);
+        slz_src_from_file(ctx, src, io->file);
+        break;
+    case FD:
+        lseek(fileno(io->file), 0, SEEK_SET);
+        slz_src_from_fd(ctx, src, fileno(io->file), 0);
+        break;
+    default:
+        abort();
+    }
+}
+
+
+/* Running. */
+static double min_time = 0.05;
+
+/* Returns the fastest time for one pass over `n' fields. */
+static double run(slz_ctx_t *ctx, const bench_case_t *c, bench_io_t *io,
+                  bool get, size_t n)
+{
+    double best = 0;
+    for (int r = 0; r < NRUNS; ++r) {
+        size_t iters = 0;
+        double start = now(), elapsed;
+        do {
+            if (get) {
+                slz_src_t src;
+                open_src(ctx, io, &src);
+                c->get(ctx, &src, n);
+                slz_src_destroy(ctx, &src);
+            }
+            else {
+                slz_sink_t sink;
+                open_sink(ctx, io, &sink);
+                c->put(ctx, &sink, n);
+                close_sink(ctx, io, &sink);
+            }
+            iters++;
+        } while ((elapsed = now() - start) < min_time);
+        double t = elapsed / iters;
+        if (!r || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void report(const bench_case_t *c, const char *op, bench_io_t *io,
+                   size_t size, size_t n, double t)
+{
+    printf("%s\t%s\t%s\t%zu\t%zu\t%zu\t%.1f\t%.3f\n",
+           c->name, op, transport_names[io->transport], size, io->len, n,
+           io->len / t / 1e6, t * 1e9 / n);
+}
+
+static bool wanted(const char *name, int nfilters, char **filters)
+{
+    if (!nfilters)
+        return true;
+    for (int i = 0; i < nfilters; ++i)
+        if (strstr(name, filters[i]))
+            return true;
+    return false;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-t SECONDS] [-s SIZE]... [-x TRANSPORT]... "
+            "[SUBSTRING...]\n", progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    char *progname = argv[0];
+    size_t sizes[16] = { 4096, 256 * 1024, 16 * 1024 * 1024 };
+    size_t nsizes = 3;
+    bool transports[NTRANSPORTS] = { true, true, true };
+    bool user_sizes = false, user_transports = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (i + 1 == argc)
+            usage(progname);
+        if (!strcmp(argv[i], "-t"))
+            min_time = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-s")) {
+            if (!user_sizes)
+                nsizes = 0;
+            user_sizes = true;
+            if (nsizes == sizeof sizes / sizeof *sizes)
+                usage(progname);
+            sizes[nsizes++] = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-x")) {
+            if (!user_transports)
+                memset(transports, 0, sizeof transports);
+            user_transports = true;
+            const char *name = argv[++i];
+            int t = 0;
+            while (t < NTRANSPORTS && strcmp(name, transport_names[t]))
+                t++;
+            if (t == NTRANSPORTS)
+                usage(progname);
+            transports[t] = true;
+        }
+        else
+            usage(progname);
+    }
+
+#ifndef SLZ_RELEASE
+    fprintf(stderr, "%s: warning: not built with MODE=release\n", progname);
+#endif
+
+    slz_ctx_t ctx;
+    slz_init_with_perror(&ctx, progname);
+    if (slz_catch(&ctx)) {
+        slz_perror(&ctx, progname);
+        exit(EXIT_FAILURE);
+    }
+
+    init_vals();
+    FILE *scratch = tmpfile();
+    if (!scratch) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("# case\top\ttransport\tsize\tbytes\tfields\tMB/s\tns/field\n");
+    for (size_t c = 0; c < NCASES; ++c) {
+        if (!wanted(cases[c].name, argc - i, argv + i))
+            continue;
+        for (int t = 0; t < NTRANSPORTS; ++t) {
+            if (!transports[t])
+                continue;
+            for (size_t s = 0; s < nsizes; ++s) {
+                size_t n = sizes[s] / cases[c].width;
+                n = n ? n : 1;
+                bench_io_t io = { (enum transport) t, scratch, NULL, 0 };
+                report(&cases[c], "put", &io, sizes[s], n,
+                       run(&ctx, &cases[c], &io, false, n));
+                report(&cases[c], "get", &io, sizes[s], n,
+                       run(&ctx, &cases[c], &io, true, n));
+                fflush(stdout);
+                free(io.mem);
+            }
+        }
+    }
+
+    fclose(scratch);
+    return 0;
+}
@@ -9,7 +9,13 @@ CC=gcc
 CCLD=$(CC)
 AR=ar
 CFLAGS+= -std=c99 -pedantic -Wall -Wextra -Werror -pipe
-LDFLAGS+=
+# So that C++ exceptions thrown by error handlers (see slz.hpp) can unwind
+# through libslz.
+CFLAGS+= -fexceptions
+# For the thread pool in slz_parallel.c. Programs linking against libslz need
+# it too.
+CFLAGS+= -pthread
+LDFLAGS+= -pthread
 
 CFLAGS_DEBUG= -O0 -ggdb3
 CFLAGS_RELEASE= -O2 -DNDEBUG -DSLZ_RELEASE
@@ -31,6 +37,11 @@ else
 $(error "unknown build mode: $(MODE)")
 endif
 
+# STATS=no compiles out the counting behind slz_ctx_set_stats & co.
+ifeq (no,$(STATS))
+CFLAGS+= -DSLZ_NO_STATS
+endif
+
 
 # For building with clang. Notably, don't have to change any compilation flags.
 # NB. Compiling with clang gives nicer compilation error messages, but forfeits
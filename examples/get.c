@@ -42,16 +42,14 @@ int main(int argc, char **argv)
     slz_src_from_file(&ctx, &src, f);
     slz_expect_magic(&ctx, &src);
 
-    /* Deserialize from file. */
+    /* Deserialize from file. The strings all go in one arena. */
+    slz_arena_t arena;
+    slz_arena_init(&arena, 0);
     int nstrs = (int) slz_get_int32(&ctx, &src);
     char **strs = xmalloc(nstrs * sizeof(char*));
 
-    for (int i = 0; i < nstrs; ++i) {
-        size_t len = slz_get_uint64(&ctx, &src);
-        char *str = strs[i] = xmalloc(len + 1);
-        slz_get_bytes(&ctx, &src, len, str);
-        str[len] = 0;           /* null-terminate */
-    }
+    for (int i = 0; i < nstrs; ++i)
+        strs[i] = slz_get_str_arena(&ctx, &src, &arena, NULL);
 
     fclose(f);
 
@@ -60,5 +58,7 @@ int main(int argc, char **argv)
     for (int i = 0; i < nstrs; ++i)
         printf("%s\n", strs[i]);
 
+    slz_arena_free(&arena);
+    free(strs);
     return 0;
 }
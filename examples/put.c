@@ -27,14 +27,13 @@ int main(int argc, char **argv)
 
     /* Serialize to the file. */
     assert (sizeof(int) <= sizeof(int32_t));
-    assert (sizeof(size_t) <= sizeof(uint64_t));
 
     slz_put_int32(&ctx, &sink, (int32_t) (argc - 1));
-    for (int i = 1; i < argc; ++i) {
-        size_t len = strlen(argv[i]);
-        slz_put_uint64(&ctx, &sink, len);
-        slz_put_bytes(&ctx, &sink, len, argv[i]);
-    }
+    for (int i = 1; i < argc; ++i)
+        slz_put_str(&ctx, &sink, argv[i]);
+
+    slz_sink_flush(&ctx, &sink);
+    slz_sink_destroy(&ctx, &sink);
 
     return 0;
 }
@@ -2,14 +2,14 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include "slz.h"
+#include "slz_internal.h"
 
 #include <errno.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define ARRAY_LEN(arr) (sizeof(arr) / sizeof((arr)[0]))
+#include <time.h>
 
 /* The magic bytes (not including version identifier) that we expect at the
  * beginning of a slz value.
@@ -22,14 +22,140 @@ static const char magic[] = "slz-";
 #define S(x) S2(x)
 #define ID(x) x          /* this is here to make emacs' auto indentation work */
 static const char version_string[] =
-    ID(S(SLZ_VERSION_MAJOR) "." S(SLZ_VERSION_MINOR) "." S(SLZ_VERSION_BUGFIX));
+    ID(S(SLZ_FORMAT_VERSION_MAJOR) "." S(SLZ_FORMAT_VERSION_MINOR) "."
+       S(SLZ_FORMAT_VERSION_BUGFIX));
 
-/* Useful internal helpers */
-#define IMPOSSIBLE do { assert(0); abort(); } while (0)
+/* Flags slz_get_magic deals with itself, rather than leaving to a caller who
+ * may not be expecting them. */
+#define SELF_HANDLED_FLAGS SLZ_HEADER_LITTLE_ENDIAN
+
+/* What malloc's alignment is good for; anything more takes posix_memalign. */
+#define MALLOC_ALIGN 16
+
+/* Statistics. Transport calls are bracketed by call_start, which notes the
+ * time if anyone is counting, and call_done, which counts them. */
+#ifndef SLZ_NO_STATS
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void count_call(slz_stats_t *stats, enum slz_stats_call call,
+                       size_t bytes, unsigned bucket)
+{
+    if (call < SLZ_CALL_WRITE)
+        stats->bytes_in += bytes;
+    else
+        stats->bytes_out += bytes;
+    stats->calls[call]++;
+    stats->latency[bucket]++;
+}
+#endif
+
+static inline uint64_t call_start(slz_ctx_t *ctx, slz_stats_t *own)
+{
+#ifndef SLZ_NO_STATS
+    if (ctx->stats || own)
+        return now_ns();
+#endif
+    (void) ctx; (void) own;
+    return 0;
+}
+
+static inline void call_done(slz_ctx_t *ctx, slz_stats_t *own,
+                             enum slz_stats_call call, size_t bytes,
+                             uint64_t start)
+{
+#ifndef SLZ_NO_STATS
+    if (!ctx->stats && !own)
+        return;
+    uint64_t ns = now_ns() - start;
+    unsigned bucket = ns ? 63 - (unsigned) __builtin_clzll(ns) : 0;
+    if (bucket >= SLZ_STATS_NBUCKETS)
+        bucket = SLZ_STATS_NBUCKETS - 1;
+    if (ctx->stats)
+        count_call(ctx->stats, call, bytes, bucket);
+    if (own && own != ctx->stats)
+        count_call(own, call, bytes, bucket);
+#else
+    (void) ctx; (void) own; (void) call; (void) bytes; (void) start;
+#endif
+}
+
+/* Errors are counted by the context once, when first raised or made sticky
+ * (a sticky error can be raised afterwards, as when a layered sink's flush
+ * fails); and by the source or sink whose transport call failed. */
+static void count_error(slz_ctx_t *ctx, slz_stats_t *own)
+{
+#ifndef SLZ_NO_STATS
+    if (own)
+        own->errors[ctx->state]++;
+    else if (!ctx->error_counted) {
+        ctx->error_counted = true;
+        if (ctx->stats)
+            ctx->stats->errors[ctx->state]++;
+    }
+#else
+    (void) ctx; (void) own;
+#endif
+}
 
-static void slz_reraise(slz_ctx_t *ctx)
+static void count_flush(slz_ctx_t *ctx, slz_sink_t *sink)
+{
+#ifndef SLZ_NO_STATS
+    if (ctx->stats)
+        ctx->stats->flushes++;
+    if (sink->stats && sink->stats != ctx->stats)
+        sink->stats->flushes++;
+#else
+    (void) ctx; (void) sink;
+#endif
+}
+
+void slz_ctx_set_stats(slz_ctx_t *ctx, slz_stats_t *stats) {
+    ctx->stats = stats;
+}
+
+void slz_src_set_stats(slz_src_t *src, slz_stats_t *stats) {
+    src->stats = stats;
+}
+
+void slz_sink_set_stats(slz_sink_t *sink, slz_stats_t *stats) {
+    sink->stats = stats;
+}
+
+void slz_stats_reset(slz_stats_t *stats) {
+    memset(stats, 0, sizeof *stats);
+}
+
+void slz_stats_snapshot(slz_stats_t *stats, slz_stats_t *out, bool reset)
+{
+    *out = *stats;
+    if (reset)
+        slz_stats_reset(stats);
+}
+
+void slz_stats_add(slz_stats_t *into, const slz_stats_t *from)
+{
+    into->bytes_in += from->bytes_in;
+    into->bytes_out += from->bytes_out;
+    for (size_t i = 0; i < SLZ_NCALLS; ++i)
+        into->calls[i] += from->calls[i];
+    into->flushes += from->flushes;
+    for (size_t i = 0; i < SLZ_NSTATES; ++i)
+        into->errors[i] += from->errors[i];
+    for (size_t i = 0; i < SLZ_STATS_NBUCKETS; ++i)
+        into->latency[i] += from->latency[i];
+}
+
+
+/* Useful internal helpers */
+void slz_reraise(slz_ctx_t *ctx)
 {
     assert (!slz_ok(ctx));
+    count_error(ctx, NULL);
     if (ctx->have_env) {
         ctx->have_env = false;
         longjmp(ctx->env, 1);
@@ -40,7 +166,7 @@ static void slz_reraise(slz_ctx_t *ctx)
     }
 }
 
-static void slz_raise(slz_ctx_t *ctx, slz_origin_t origin_type, void *origin)
+void slz_raise(slz_ctx_t *ctx, slz_origin_t origin_type, void *origin)
 {
     ctx->origin_type = (uint8_t) origin_type;
     switch (origin_type) {
@@ -50,16 +176,55 @@ static void slz_raise(slz_ctx_t *ctx, slz_origin_t origin_type, void *origin)
     slz_reraise(ctx);
 }
 
-static void *slz_malloc(slz_ctx_t *ctx, size_t sz) {
-    void *p = malloc(sz);
-    if (!p) {
+void *slz_try_malloc_aligned(slz_ctx_t *ctx, size_t sz, size_t align) {
+    const slz_allocator_t *a = ctx->allocator;
+    void *p;
+    if (!sz)
+        sz = 1;
+    if (a)
+        p = a->alloc(a->userdata, sz, align);
+    else if (align <= MALLOC_ALIGN)
+        p = malloc(sz);
+    else if (posix_memalign(&p, align, sz))
+        p = NULL;
+    if (!p)
         ctx->state = SLZ_OOM;
+    return p;
+}
+
+void *slz_try_malloc(slz_ctx_t *ctx, size_t sz) {
+    return slz_try_malloc_aligned(ctx, sz, MALLOC_ALIGN);
+}
+
+void *slz_malloc(slz_ctx_t *ctx, size_t sz) {
+    void *p = slz_try_malloc(ctx, sz);
+    if (!p)
         slz_reraise(ctx);
-    }
     assert (p);
     return p;
 }
 
+void slz_allocator_free(const slz_allocator_t *allocator, void *p) {
+    if (!allocator)
+        free(p);
+    else if (p)
+        allocator->free(allocator->userdata, p);
+}
+
+size_t slz_strerror_msg(char *buf, size_t buflen, const char *msg)
+{
+    size_t len = strlen(msg) + 1;
+    if (buflen < len)
+        return len;
+    memcpy(buf, msg, len);
+    return 0;
+}
+
+size_t slz_strerror_errno(char *buf, size_t buflen, int errnum)
+{
+    return strerror_r(errnum, buf, buflen) ? SIZE_MAX : 0;
+}
+
 static void perrorish(const char *s, const char *fmt, ...)
 {
     va_list ap;
@@ -83,12 +248,18 @@ slz_version_t slz_version(void)
                 });
 }
 
+slz_version_t slz_format_version(void)
+{
+    return ((slz_version_t) { .major = SLZ_FORMAT_VERSION_MAJOR,
+                .minor = SLZ_FORMAT_VERSION_MINOR,
+                .bugfix = SLZ_FORMAT_VERSION_BUGFIX
+                });
+}
+
 bool slz_compatible_version(slz_version_t version)
 {
-    /* TODO: be more relaxed about this */
-    return (version.major == SLZ_VERSION_MAJOR &&
-            version.minor == SLZ_VERSION_MINOR &&
-            version.bugfix == SLZ_VERSION_BUGFIX);
+    return (version.major == SLZ_FORMAT_VERSION_MAJOR &&
+            version.minor <= SLZ_FORMAT_VERSION_MINOR);
 }
 
 
@@ -102,6 +273,9 @@ void slz_init(slz_ctx_t *ctx,
     ctx->have_env = false;
     ctx->toplevel_error_handler = handler;
     ctx->userdata = userdata;
+    ctx->stats = NULL;
+    ctx->error_counted = false;
+    ctx->allocator = NULL;
 }
 
 static void perror_handler(slz_ctx_t *ctx, void *data) {
@@ -112,8 +286,21 @@ void slz_init_with_perror(slz_ctx_t *ctx, const char *s) {
     slz_init(ctx, perror_handler, (void*) s);
 }
 
+void slz_set_allocator(slz_ctx_t *ctx, const slz_allocator_t *allocator) {
+    ctx->allocator = allocator;
+}
+
+void *slz_alloc(slz_ctx_t *ctx, size_t size) {
+    return slz_malloc(ctx, size);
+}
+
+void slz_free(slz_ctx_t *ctx, void *ptr) {
+    slz_allocator_free(ctx->allocator, ptr);
+}
+
 void slz_clear_error(slz_ctx_t *ctx) {
     ctx->state = SLZ_OK;
+    ctx->error_counted = false;
 }
 
 
@@ -204,6 +391,22 @@ void slz_perror(slz_ctx_t *ctx, const char *s)
         perrorish(s, "libslz: out of memory");
         break;
 
+      case SLZ_MALFORMED:
+        perrorish(s, "libslz: malformed data");
+        break;
+
+      case SLZ_BAD_CHECKSUM:
+        perrorish(s, "libslz: checksum mismatch; data is corrupt");
+        break;
+
+      case SLZ_INCOMPLETE:
+        perrorish(s, "libslz: incomplete data");
+        break;
+
+      case SLZ_CANT_SEEK:
+        perrorish(s, "libslz: can't seek back that far in this source");
+        break;
+
       case SLZ_OK: IMPOSSIBLE;
     }
 }
@@ -223,6 +426,12 @@ void slz_src_init(
     src->error = false;
     src->funcs = funcs;
     src->obj = obj;
+    src->pos = src->end = src->buf = NULL;
+    src->bufsize = 0;
+    src->offset = 0;
+    src->little_endian = false;
+    src->stats = NULL;
+    src->intern = NULL;
     (void) ctx;                 /* unused */
 }
 
@@ -233,22 +442,64 @@ void slz_sink_init(
     sink->error = false;
     sink->funcs = funcs;
     sink->obj = obj;
+    sink->buf = sink->pos = sink->end = NULL;
+    sink->little_endian = false;
+    sink->stats = NULL;
+    sink->intern = NULL;
     (void) ctx;                 /* unused */
 }
 
 void slz_src_destroy(slz_ctx_t *ctx, slz_src_t *src) {
+    slz_free(ctx, src->buf);
     src->funcs->free(src->obj);
-    (void) ctx;
 }
 
 void slz_sink_destroy(slz_ctx_t *ctx, slz_sink_t *sink) {
+    slz_free(ctx, sink->buf);
     sink->funcs->free(sink->obj);
-    (void) ctx;
+}
+
+/* The built-in slz_*_reset_* functions reuse the old object by passing it back
+ * in, so it's only freed if it's being replaced. */
+void slz_src_reset(
+    slz_ctx_t *ctx, slz_src_t *src, slz_src_funcs_t *funcs, void *obj)
+{
+    char *buf = src->buf;
+    size_t bufsize = src->bufsize;
+    slz_stats_t *stats = src->stats;
+    slz_intern_t *intern = src->intern;
+    if (obj != src->obj)
+        src->funcs->free(src->obj);
+    slz_src_init(ctx, src, funcs, obj);
+    src->pos = src->end = src->buf = buf;
+    src->bufsize = bufsize;
+    src->stats = stats;
+    src->intern = intern;
+}
+
+void slz_sink_reset(
+    slz_ctx_t *ctx, slz_sink_t *sink, slz_sink_funcs_t *funcs, void *obj)
+{
+    char *buf = sink->buf, *end = sink->end;
+    slz_stats_t *stats = sink->stats;
+    slz_intern_t *intern = sink->intern;
+    if (obj != sink->obj)
+        sink->funcs->free(sink->obj);
+    slz_sink_init(ctx, sink, funcs, obj);
+    sink->buf = sink->pos = buf;
+    sink->end = end;
+    sink->stats = stats;
+    sink->intern = intern;
 }
 
 
 /* File vtables and methods. */
-typedef struct { FILE *file; bool eof; int saved_errno; } file_t;
+typedef struct {
+    FILE *file;
+    bool eof;
+    int saved_errno;
+    const slz_allocator_t *allocator;
+} file_t;
 
 static bool FILE_read(void *objp, char *buf, size_t buflen)
 {
@@ -262,6 +513,17 @@ static bool FILE_read(void *objp, char *buf, size_t buflen)
     return true;
 }
 
+static size_t FILE_read_some(void *objp, char *buf, size_t buflen)
+{
+    file_t *obj = objp;
+    size_t read = fread(buf, 1, buflen, obj->file);
+    if (!read) {
+        if (feof(obj->file)) obj->eof = true;
+        else obj->saved_errno = errno;
+    }
+    return read;
+}
+
 static bool FILE_write(void *objp, const char *buf, size_t buflen)
 {
     file_t *obj = objp;
@@ -276,35 +538,83 @@ static bool FILE_write(void *objp, const char *buf, size_t buflen)
 static size_t FILE_strerror(void *objp, char *buf, size_t buflen)
 {
     file_t *obj = objp;
-    if (obj->eof) {
-        static const char msg[] = "end-of-file reached";
-        if (buflen < ARRAY_LEN(msg))
-            return ARRAY_LEN(msg);
-        memcpy(buf, msg, ARRAY_LEN(msg));
-        return 0;
-    }
+    if (obj->eof)
+        return slz_strerror_msg(buf, buflen, "end-of-file reached");
 
     return strerror_r(obj->saved_errno, buf, buflen) ? SIZE_MAX : 0;
 }
 
+static bool FILE_seek(
+    slz_ctx_t *ctx, void *objp, slz_src_t *src, uint64_t offset)
+{
+    file_t *obj = objp;
+    obj->eof = false;
+
+    /* We've read the file up to src->offset, wherever it started. */
+    off_t here = ftello(obj->file);
+    if (here >= 0) {
+        if (fseeko(obj->file, here - (off_t) src->offset + (off_t) offset,
+                   SEEK_SET)) {
+            obj->saved_errno = errno;
+            return false;
+        }
+        return true;
+    }
+
+    /* A pipe, say: read our way there. */
+    if (offset < src->offset) {
+        obj->saved_errno = ESPIPE;
+        return false;
+    }
+    char scratch[4096];
+    for (uint64_t left = offset - src->offset; left; ) {
+        size_t n = left < sizeof scratch ? (size_t) left : sizeof scratch;
+        if (!FILE_read(obj, scratch, n))
+            return false;
+        left -= n;
+    }
+    (void) ctx;
+    return true;
+}
+
+static void FILE_free(void *objp)
+{
+    file_t *obj = objp;
+    slz_allocator_free(obj->allocator, obj);
+}
+
 static slz_src_funcs_t FILE_src_funcs = {
     .read = FILE_read,
     .strerror = FILE_strerror,
-    .free = free
+    .free = FILE_free,
+    .read_some = FILE_read_some,
+    .seek = FILE_seek
 };
 
 static slz_sink_funcs_t FILE_sink_funcs = {
     .write = FILE_write,
     .strerror = FILE_strerror,
-    .free = free
+    .free = FILE_free
 };
 
 /* File initializers. */
-void slz_src_from_file(slz_ctx_t *ctx, slz_src_t *src, FILE *file)
+
+/* Sets up `f' (allocated if NULL) for `file'. */
+static file_t *file_init(slz_ctx_t *ctx, file_t *f, FILE *file)
 {
-    file_t *f = slz_malloc(ctx, sizeof(file_t));
+    if (!f) {
+        f = slz_malloc(ctx, sizeof(file_t));
+        f->allocator = ctx->allocator;
+    }
     f->file = file;
     f->eof = false;
+    f->saved_errno = 0;
+    return f;
+}
+
+void slz_src_from_file(slz_ctx_t *ctx, slz_src_t *src, FILE *file)
+{
+    file_t *f = file_init(ctx, NULL, file);
     slz_src_init(ctx, src, &FILE_src_funcs, (void*) f);
     /* FIXME: check that file is open for reading. */
     /* FIXME: check file for error conditions. */
@@ -312,133 +622,492 @@ void slz_src_from_file(slz_ctx_t *ctx, slz_src_t *src, FILE *file)
 
 void slz_sink_from_file(slz_ctx_t *ctx, slz_sink_t *sink, FILE *file)
 {
-    file_t *f = slz_malloc(ctx, sizeof(file_t));
-    f->file = file;
-    f->eof = false;
+    file_t *f = file_init(ctx, NULL, file);
     /* FIXME: check that file is open for writing */
     /* FIXME: check file for error conditions */
     slz_sink_init(ctx, sink, &FILE_sink_funcs, (void*) f);
 }
 
+void slz_src_reset_file(slz_ctx_t *ctx, slz_src_t *src, FILE *file)
+{
+    file_t *f = src->funcs == &FILE_src_funcs ? src->obj : NULL;
+    slz_src_reset(ctx, src, &FILE_src_funcs, file_init(ctx, f, file));
+}
+
+void slz_sink_reset_file(slz_ctx_t *ctx, slz_sink_t *sink, FILE *file)
+{
+    file_t *f = sink->funcs == &FILE_sink_funcs ? sink->obj : NULL;
+    slz_sink_reset(ctx, sink, &FILE_sink_funcs, file_init(ctx, f, file));
+}
+
+
+/* Memory vtables and methods.
+ *
+ * Neither needs an object: a memory source's window is the data itself, and a
+ * memory sink's buffer is the memory it's serializing to. */
+static bool mem_read(void *obj, char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* mem_fill is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static bool mem_write(void *obj, const char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* mem_flush is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t mem_strerror(void *obj, char *buf, size_t buflen)
+{
+    (void) obj;
+    return slz_strerror_msg(buf, buflen, "end of data in memory reached");
+}
+
+static void mem_free(void *obj) { (void) obj; }
+
+static bool mem_fill(slz_ctx_t *ctx, void *obj, slz_src_t *src, size_t need)
+{
+    /* All there is is already in the window. */
+    (void) ctx; (void) obj; (void) src; (void) need;
+    return false;
+}
+
+static bool mem_seek(
+    slz_ctx_t *ctx, void *obj, slz_src_t *src, uint64_t offset)
+{
+    /* The window is all the data, and ends where it does. */
+    if (offset > src->offset) {
+        src->pos = src->end;
+        return false;
+    }
+    src->pos = src->end - (src->offset - offset);
+    (void) ctx; (void) obj;
+    return true;
+}
+
+static bool mem_flush(slz_ctx_t *ctx, void *obj, slz_sink_t *sink, size_t need)
+{
+    size_t used = sink->pos - sink->buf;
+    size_t size = sink->end - sink->buf;
+    if (size - used >= need)
+        return true;
+
+    /* Grow geometrically, to keep the total cost of copying linear. */
+    size_t new_size = size ? size : 256;
+    while (new_size - used < need) {
+        if (new_size * 2 < new_size) {
+            ctx->state = SLZ_OOM;
+            return false;
+        }
+        new_size *= 2;
+    }
+
+    char *buf = slz_try_malloc(ctx, new_size);
+    if (!buf)
+        return false;
+    if (used)
+        memcpy(buf, sink->buf, used);
+    slz_free(ctx, sink->buf);
+    sink->buf = buf;
+    sink->pos = buf + used;
+    sink->end = buf + new_size;
+    (void) obj;
+    return true;
+}
+
+static slz_src_funcs_t mem_src_funcs = {
+    .read = mem_read,
+    .strerror = mem_strerror,
+    .free = mem_free,
+    .fill = mem_fill,
+    .seek = mem_seek
+};
+
+static slz_sink_funcs_t mem_sink_funcs = {
+    .write = mem_write,
+    .strerror = mem_strerror,
+    .free = mem_free,
+    .flush = mem_flush
+};
+
+/* Memory initializers. */
+void slz_src_from_memory(
+    slz_ctx_t *ctx, slz_src_t *src, const char *data, size_t len)
+{
+    slz_src_init(ctx, src, &mem_src_funcs, NULL);
+    src->pos = data;
+    src->end = data + len;
+    src->offset = len;
+}
+
+void slz_src_reset_memory(
+    slz_ctx_t *ctx, slz_src_t *src, const char *data, size_t len)
+{
+    slz_src_reset(ctx, src, &mem_src_funcs, NULL);
+    src->pos = data;
+    src->end = data + len;
+    src->offset = len;
+}
+
+void slz_sink_to_memory(slz_ctx_t *ctx, slz_sink_t *sink)
+{
+    slz_sink_init(ctx, sink, &mem_sink_funcs, NULL);
+}
+
+void slz_sink_reset_memory(slz_ctx_t *ctx, slz_sink_t *sink)
+{
+    slz_sink_reset(ctx, sink, &mem_sink_funcs, NULL);
+}
+
+char *slz_sink_memory_release(slz_ctx_t *ctx, slz_sink_t *sink, size_t *len)
+{
+    assert (sink->funcs == &mem_sink_funcs);
+    char *buf = sink->buf;
+    *len = sink->pos - sink->buf;
+    sink->buf = sink->pos = sink->end = NULL;
+    (void) ctx;
+    return buf;
+}
+
+
 
 /* Serialization */
-void slz_put_bytes(
-    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
+static bool sink_failed(slz_ctx_t *ctx, slz_sink_t *sink)
+{
+    if (slz_ok(ctx))
+        ctx->state = SLZ_IO_ERROR;
+    if (sink->stats)
+        count_error(ctx, sink->stats);
+    ctx->origin_type = SLZ_SINK;
+    ctx->origin.sink = sink;
+    return false;
+}
+
+/* Empties the write buffer into the underlying sink and makes sure it has at
+ * least `need' bytes of free space. */
+static bool try_flush(slz_ctx_t *ctx, slz_sink_t *sink, size_t need)
 {
     assert (slz_ok(ctx));
     assert (!sink->error);
 
-    if (!sink->funcs->write(sink->obj, data, len)) {
-        ctx->state = SLZ_IO_ERROR;
-        slz_raise(ctx, SLZ_SINK, sink);
+    size_t pending = sink->pos - sink->buf;
+    if (sink->funcs->flush) {
+        uint64_t start = call_start(ctx, sink->stats);
+        bool ok = sink->funcs->flush(ctx, sink->obj, sink, need);
+        call_done(ctx, sink->stats, SLZ_CALL_FLUSH, pending, start);
+        if (!ok)
+            return sink_failed(ctx, sink);
+        assert ((size_t) (sink->end - sink->pos) >= need);
+        return true;
+    }
+
+    if (pending) {
+        uint64_t start = call_start(ctx, sink->stats);
+        bool ok = sink->funcs->write(sink->obj, sink->buf, pending);
+        call_done(ctx, sink->stats, SLZ_CALL_WRITE, pending, start);
+        if (!ok)
+            return sink_failed(ctx, sink);
     }
+    sink->pos = sink->buf;
+
+    if (!slz_sink_try_alloc(ctx, sink, need, SLZ_BUFSIZE))
+        return sink_failed(ctx, sink);
+    return true;
 }
 
-void slz_put_magic(slz_ctx_t *ctx, slz_sink_t *sink)
+bool slz_sink_try_alloc(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t need, size_t min_size)
 {
-    /* Write magic number & version info. */
-    slz_put_bytes(ctx, sink, strlen(magic), magic);
-    /* sizeof rather than strlen to include the terminating null byte. */
-    slz_put_bytes(ctx, sink, sizeof version_string, version_string);
+    assert (sink->pos == sink->buf);
+    if ((size_t) (sink->end - sink->buf) >= need)
+        return true;
+
+    size_t size = need > min_size ? need : min_size;
+    char *buf = slz_try_malloc(ctx, size);
+    if (!buf)
+        return false;
+    slz_free(ctx, sink->buf);
+    sink->buf = sink->pos = buf;
+    sink->end = buf + size;
+    return true;
 }
 
-void slz_put_bool(slz_ctx_t *ctx, slz_sink_t *sink, bool val)
+void slz_sink_flush(slz_ctx_t *ctx, slz_sink_t *sink)
 {
-    /* TODO: read C spec. is this really OK? */
-    char byte = val ? 1 : 0;
-    slz_put_bytes(ctx, sink, 1, &byte);
+    count_flush(ctx, sink);
+    if (!try_flush(ctx, sink, 0))
+        slz_reraise(ctx);
 }
 
-void slz_put_uint8(slz_ctx_t *ctx, slz_sink_t *sink, uint8_t val)
+void slz_PRIVATE_sink_make_room(slz_ctx_t *ctx, slz_sink_t *sink, size_t len)
 {
-    /* TODO: read C spec. is this really OK? */
-    slz_put_bytes(ctx, sink, 1, (char*)&val);
+    if (!try_flush(ctx, sink, len))
+        slz_reraise(ctx);
 }
 
-void slz_put_int8(slz_ctx_t *ctx, slz_sink_t *sink, int8_t val)
+static bool try_put_bytes(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
 {
-    /* TODO: read C spec. is this really OK? */
-    slz_put_uint8(ctx, sink, (uint8_t) val);
+    assert (slz_ok(ctx));
+    assert (!sink->error);
+
+    /* Large writes to a libslz-managed buffer skip the buffer entirely. */
+    if (!sink->funcs->flush && len >= SLZ_BUFSIZE) {
+        if (!try_flush(ctx, sink, 0))
+            return false;
+        uint64_t start = call_start(ctx, sink->stats);
+        bool ok = sink->funcs->write(sink->obj, data, len);
+        call_done(ctx, sink->stats, SLZ_CALL_WRITE, len, start);
+        if (!ok)
+            return sink_failed(ctx, sink);
+        return true;
+    }
+
+    if ((size_t) (sink->end - sink->pos) < len && !try_flush(ctx, sink, len))
+        return false;
+    memcpy(sink->pos, data, len);
+    sink->pos += len;
+    return true;
 }
 
-void slz_put_uint16(slz_ctx_t *ctx, slz_sink_t *sink, uint16_t val)
+void slz_PRIVATE_put_bytes(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
 {
-    /* NB. big-endian. */
-    char bytes[] = { val >> 8, val % 256 };
-    slz_put_bytes(ctx, sink, 2, bytes);
+    if (!try_put_bytes(ctx, sink, len, data))
+        slz_reraise(ctx);
 }
 
-void slz_put_int16(slz_ctx_t *ctx, slz_sink_t *sink, int16_t val)
+void slz_put_magic(slz_ctx_t *ctx, slz_sink_t *sink)
 {
-    /* TODO: read C spec. is this really OK? */
-    slz_put_uint16(ctx, sink, (uint16_t) val);
+    slz_put_magic_flags(ctx, sink, 0);
 }
 
-void slz_put_uint32(slz_ctx_t *ctx, slz_sink_t *sink, uint32_t val)
+void slz_put_magic_flags(slz_ctx_t *ctx, slz_sink_t *sink, unsigned flags)
 {
-    /* NB. big-endian. */
-    char bytes[] = {val >> 24, (val >> 16) % 256, (val >> 8) % 256, val % 256};
-    slz_put_bytes(ctx, sink, sizeof bytes, bytes);
+    assert (!(flags & ~SLZ_HEADER_KNOWN_FLAGS));
+    /* Write magic number & version info. */
+    slz_put_bytes(ctx, sink, strlen(magic), magic);
+    /* sizeof rather than strlen to include the terminating null byte. */
+    slz_put_bytes(ctx, sink, sizeof version_string, version_string);
+    slz_put_uint8(ctx, sink, (uint8_t) flags);
+    sink->little_endian = (flags & SLZ_HEADER_LITTLE_ENDIAN) != 0;
 }
 
-void slz_put_int32(slz_ctx_t *ctx, slz_sink_t *sink, int32_t val)
+
+/* Deserialization. */
+static bool src_failed(slz_ctx_t *ctx, slz_src_t *src)
 {
-    /* TODO: read C spec. is this really OK? */
-    slz_put_uint32(ctx, sink, (uint32_t) val);
+    if (slz_ok(ctx))
+        ctx->state = SLZ_IO_ERROR;
+    if (src->stats)
+        count_error(ctx, src->stats);
+    ctx->origin_type = SLZ_SRC;
+    ctx->origin.src = src;
+    return false;
 }
 
-void slz_put_uint64(slz_ctx_t *ctx, slz_sink_t *sink, uint64_t val)
+/* Makes sure at least `need' bytes are available in the read-ahead window. */
+static bool try_fill(slz_ctx_t *ctx, slz_src_t *src, size_t need)
 {
-    /* NB. big-endian. */
-    slz_put_uint32(ctx, sink, val >> 32);
-    slz_put_uint32(ctx, sink, val % (((uint64_t)1) << 32));
+    assert (slz_ok(ctx));
+    assert (!src->error);
+
+    size_t have = src->end - src->pos;
+    if (have >= need)
+        return true;
+
+    if (src->funcs->fill) {
+        uint64_t start = call_start(ctx, src->stats);
+        bool ok = src->funcs->fill(ctx, src->obj, src, need);
+        size_t n = ok ? (size_t) (src->end - src->pos) - have : 0;
+        call_done(ctx, src->stats, SLZ_CALL_FILL, n, start);
+        if (!ok)
+            return src_failed(ctx, src);
+        src->offset += n;
+        assert ((size_t) (src->end - src->pos) >= need);
+        return true;
+    }
+
+    if (!slz_src_try_compact(ctx, src, need - have, SLZ_BUFSIZE))
+        return src_failed(ctx, src);
+
+    while (have < need) {
+        uint64_t start = call_start(ctx, src->stats);
+        if (src->funcs->read_some) {
+            size_t n = src->funcs->read_some(
+                src->obj, src->buf + have, src->bufsize - have);
+            call_done(ctx, src->stats, SLZ_CALL_READ_SOME, n, start);
+            if (!n)
+                return src_failed(ctx, src);
+            have += n;
+            src->offset += n;
+        }
+        else {
+            bool ok = src->funcs->read(src->obj, src->buf + have, need - have);
+            call_done(ctx, src->stats, SLZ_CALL_READ, ok ? need - have : 0,
+                      start);
+            if (!ok)
+                return src_failed(ctx, src);
+            src->offset += need - have;
+            have = need;
+        }
+        src->end = src->buf + have;
+    }
+    return true;
 }
 
-void slz_put_int64(slz_ctx_t *ctx, slz_sink_t *sink, int64_t val)
+bool slz_src_try_compact(
+    slz_ctx_t *ctx, slz_src_t *src, size_t room, size_t min_size)
 {
-    /* TODO: read C spec. is this really OK?  */
-    slz_put_uint64(ctx, sink, (uint64_t) val);
+    size_t have = src->end - src->pos;
+    if (src->bufsize - have < room) {
+        size_t size = have + room > min_size ? have + room : min_size;
+        char *buf = slz_try_malloc(ctx, size);
+        if (!buf)
+            return false;
+        if (have)
+            memcpy(buf, src->pos, have);
+        slz_free(ctx, src->buf);
+        src->buf = buf;
+        src->bufsize = size;
+    }
+    else if (have)
+        memmove(src->buf, src->pos, have);
+    src->pos = src->buf;
+    src->end = src->buf + have;
+    return true;
 }
 
-
-/* Deserialization. */
 static bool try_get_bytes(
     slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out)
 {
     assert (slz_ok(ctx));
     assert (!src->error);
 
-    if (src->funcs->read(src->obj, out, len))
+    for (;;) {
+        size_t have = src->end - src->pos;
+        size_t n = have < len ? have : len;
+        if (n)
+            memcpy(out, src->pos, n);
+        src->pos += n;
+        out += n;
+        len -= n;
+        if (!len)
+            return true;
+
+        /* Big reads, and reads from sources we can't read ahead in, go
+         * straight to the caller's buffer. */
+        if (!src->funcs->fill &&
+            (len >= SLZ_BUFSIZE || !src->funcs->read_some)) {
+            uint64_t start = call_start(ctx, src->stats);
+            bool ok = src->funcs->read(src->obj, out, len);
+            call_done(ctx, src->stats, SLZ_CALL_READ, ok ? len : 0, start);
+            if (!ok)
+                return src_failed(ctx, src);
+            /* The buffer no longer leads up to `offset'; see try_seek. */
+            src->offset += len;
+            src->pos = src->end = src->buf;
+            return true;
+        }
+
+        if (!try_fill(ctx, src, 1))
+            return false;
+    }
+}
+
+/* Moves to stream offset `offset'. */
+static bool try_seek(slz_ctx_t *ctx, slz_src_t *src, uint64_t offset)
+{
+    assert (slz_ok(ctx));
+    assert (!src->error);
+
+    /* Anywhere in the window is just a matter of moving pos. Unless a fill
+     * hook manages it, so is anywhere in our buffer before pos, which holds
+     * the stream up to `end'. */
+    const char *start = src->funcs->fill ? src->pos : src->buf;
+    uint64_t lo = src->offset - (uint64_t) (src->end - start);
+    if (lo <= offset && offset <= src->offset) {
+        src->pos = src->end - (src->offset - offset);
         return true;
+    }
 
-    ctx->origin_type = SLZ_SRC;
-    ctx->origin.src = src;
-    ctx->state = SLZ_IO_ERROR;
-    return false;
+    if (src->funcs->seek) {
+        if (!src->funcs->fill)
+            src->pos = src->end = src->buf;
+        uint64_t start_ns = call_start(ctx, src->stats);
+        bool ok = src->funcs->seek(ctx, src->obj, src, offset);
+        call_done(ctx, src->stats, SLZ_CALL_SEEK, 0, start_ns);
+        if (!ok)
+            return src_failed(ctx, src);
+        if (!src->funcs->fill)
+            src->offset = offset;
+        assert (slz_src_tell(src) == offset);
+        return true;
+    }
+
+    /* Read our way there, if it's ahead. */
+    if (offset < src->offset) {
+        ctx->state = SLZ_CANT_SEEK;
+        return src_failed(ctx, src);
+    }
+    do {
+        src->pos = src->end;
+        uint64_t left = offset - src->offset;
+        if (!try_fill(ctx, src, left < SLZ_BUFSIZE ? left : SLZ_BUFSIZE))
+            return false;
+    } while (src->offset < offset);
+    src->pos = src->end - (src->offset - offset);
+    return true;
 }
 
 static bool try_expect_bytes(
     slz_ctx_t *ctx, slz_src_t *src, size_t len, const char *data)
 {
-    /* TODO: for large values of len, this is probably a bad idea. */
-    char buf[len];
-    if (!try_get_bytes(ctx, src, len, buf))
-        return false;           /* couldn't read enough data */
-    if (!memcmp(data, buf, len))
-        return true;            /* all is well */
-    /* data not as expected */
-    ctx->origin_type = SLZ_SRC;
-    ctx->origin.src = src;
-    ctx->state = SLZ_UNFULFILLED_EXPECTATIONS;
-    return false;
+    /* Compare a window-full at a time, in place. */
+    while (len) {
+        if (!try_fill(ctx, src, len < SLZ_BUFSIZE ? len : SLZ_BUFSIZE))
+            return false;       /* couldn't read enough data */
+        size_t have = src->end - src->pos;
+        size_t n = have < len ? have : len;
+        if (memcmp(data, src->pos, n)) {
+            /* data not as expected */
+            ctx->origin_type = SLZ_SRC;
+            ctx->origin.src = src;
+            ctx->state = SLZ_UNFULFILLED_EXPECTATIONS;
+            return false;
+        }
+        src->pos += n;
+        data += n;
+        len -= n;
+    }
+    return true;                /* all is well */
+}
+
+void slz_PRIVATE_src_fill(slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    if (!try_fill(ctx, src, len))
+        slz_reraise(ctx);
 }
 
-void slz_get_bytes(slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out)
+void slz_PRIVATE_get_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out)
 {
     if (!try_get_bytes(ctx, src, len, out))
         slz_reraise(ctx);
 }
 
+void slz_PRIVATE_skip_bytes(slz_ctx_t *ctx, slz_src_t *src, uint64_t len)
+{
+    if (!try_seek(ctx, src, slz_src_tell(src) + len))
+        slz_reraise(ctx);
+}
+
+void slz_src_seek(slz_ctx_t *ctx, slz_src_t *src, uint64_t offset)
+{
+    if (!try_seek(ctx, src, offset))
+        slz_reraise(ctx);
+}
+
 void slz_expect_bytes(
     slz_ctx_t *ctx, slz_src_t *src, size_t len, const char *data)
 {
@@ -462,16 +1131,31 @@ static inline bool get_version_frag(
 }
 
 slz_version_t slz_get_magic(slz_ctx_t *ctx, slz_src_t *src)
+{
+    return slz_get_magic_flags(ctx, src, NULL);
+}
+
+slz_version_t slz_get_magic_flags(
+    slz_ctx_t *ctx, slz_src_t *src, unsigned *flagsp)
 {
     char c;
+    uint8_t flags = 0;
     slz_version_t v = {0, 0, 0};
-    if (!(try_expect_bytes(ctx, src, strlen(magic), magic) &&
-          get_version_frag(ctx, src, &v.major, &c) && c == '.' &&
-          get_version_frag(ctx, src, &v.minor, &c) && c == '.' &&
-          get_version_frag(ctx, src, &v.bugfix, &c) && c == '\0')) {
+    bool ok = try_expect_bytes(ctx, src, strlen(magic), magic) &&
+        get_version_frag(ctx, src, &v.major, &c) && c == '.' &&
+        get_version_frag(ctx, src, &v.minor, &c) && c == '.' &&
+        get_version_frag(ctx, src, &v.bugfix, &c) && c == '\0';
+    /* 0.0.0 headers end with the version; later ones have flags. */
+    if (ok && (v.major || v.minor))
+        ok = try_get_bytes(ctx, src, 1, (char*) &flags);
+    if (!ok ||
+        (flags & ~(flagsp ? SLZ_HEADER_KNOWN_FLAGS : SELF_HANDLED_FLAGS))) {
         ctx->state = SLZ_BAD_HEADER;
         slz_raise(ctx, SLZ_SRC, src);
     }
+    src->little_endian = (flags & SLZ_HEADER_LITTLE_ENDIAN) != 0;
+    if (flagsp)
+        *flagsp = flags;
     return v;
 }
 
@@ -483,54 +1167,72 @@ void slz_expect_magic(slz_ctx_t *ctx, slz_src_t *src)
     }
 }
 
-/* TODO: many of these functions are dubiously portable. */
-bool slz_get_bool(slz_ctx_t *ctx, slz_src_t *src)
+
+
+/* Sticky errors. */
+bool slz_sink_poison(slz_ctx_t *ctx, slz_sink_t *sink)
 {
-    char c;
-    slz_get_bytes(ctx, src, 1, &c);
-    return c ? true : false;
+    count_error(ctx, NULL);
+    /* No pending bytes and no free space: everything comes back to us. */
+    sink->error = true;
+    sink->pos = sink->end = sink->buf;
+    return false;
 }
 
-uint8_t slz_get_uint8(slz_ctx_t *ctx, slz_src_t *src)
+bool slz_src_poison(slz_ctx_t *ctx, slz_src_t *src)
 {
-    uint8_t v;
-    slz_get_bytes(ctx, src, 1, (char*)&v);
-    return v;
+    count_error(ctx, NULL);
+    src->error = true;
+    src->pos = src->end;
+    return false;
 }
 
-int8_t slz_get_int8(slz_ctx_t *ctx, slz_src_t *src) {
-    return (int8_t) slz_get_uint8(ctx, src);
+void slz_sink_clear_error(slz_sink_t *sink) {
+    sink->error = false;
 }
 
-uint16_t slz_get_uint16(slz_ctx_t *ctx, slz_src_t *src)
-{
-    char bytes[sizeof(uint16_t)];
-    slz_get_bytes(ctx, src, sizeof bytes, bytes);
-    return (((uint16_t) bytes[0]) << 8) + (uint16_t) bytes[1];
+void slz_src_clear_error(slz_src_t *src) {
+    src->error = false;
 }
 
-int16_t slz_get_int16(slz_ctx_t *ctx, slz_src_t *src) {
-    return (int16_t) slz_get_uint16(ctx, src);
+bool slz_PRIVATE_sink_try_make_room(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len)
+{
+    if (!slz_ok(ctx) || sink->error)
+        return false;
+    return try_flush(ctx, sink, len) || slz_sink_poison(ctx, sink);
 }
 
-uint32_t slz_get_uint32(slz_ctx_t *ctx, slz_src_t *src)
+bool slz_PRIVATE_src_try_fill(slz_ctx_t *ctx, slz_src_t *src, size_t len)
 {
-    uint32_t hi = slz_get_uint16(ctx, src);
-    uint32_t lo = slz_get_uint16(ctx, src);
-    return (hi << 16) + lo;
+    if (!slz_ok(ctx) || src->error)
+        return false;
+    return try_fill(ctx, src, len) || slz_src_poison(ctx, src);
 }
 
-int32_t slz_get_int32(slz_ctx_t *ctx, slz_src_t *src) {
-    return (int32_t) slz_get_uint32(ctx, src);
+bool slz_sink_try_flush(slz_ctx_t *ctx, slz_sink_t *sink)
+{
+    if (slz_ok(ctx) && !sink->error)
+        count_flush(ctx, sink);
+    return slz_PRIVATE_sink_try_make_room(ctx, sink, 0);
 }
 
-uint64_t slz_get_uint64(slz_ctx_t *ctx, slz_src_t *src)
+void slz_PRIVATE_try_put_bytes(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
 {
-    uint64_t hi = slz_get_uint32(ctx, src);
-    uint64_t lo = slz_get_uint32(ctx, src);
-    return (hi << 32) + lo;
+    if (!slz_ok(ctx) || sink->error)
+        return;
+    if (!try_put_bytes(ctx, sink, len, data))
+        slz_sink_poison(ctx, sink);
 }
 
-int64_t slz_get_int64(slz_ctx_t *ctx, slz_src_t *src) {
-    return (int64_t) slz_get_uint64(ctx, src);
+void slz_PRIVATE_try_get_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out)
+{
+    if (slz_ok(ctx) && !src->error) {
+        if (try_get_bytes(ctx, src, len, out))
+            return;
+        slz_src_poison(ctx, src);
+    }
+    memset(out, 0, len);
 }
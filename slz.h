@@ -6,53 +6,85 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* ---------- ON VERSION NUMBERS ----------
  *
- * To change version numbers, edit the Makefile.
- *
- * TODO: Separate the serialization format version from the library version.
- *
- * NB. The remainder of this comment is a collection of LIES. It serves as an
- * extended TODO. At present, if the version of the library and the encoded
- * value do not match, an error is raised. (YAGNI.)
+ * There are two: the library's, which slz_version returns (to change it, edit
+ * the Makefile), and the serialization format's, below, which is what the
+ * header records. They move independently; a release that doesn't change
+ * what's written doesn't change the format version.
  *
- * TODO:
+ * Consider a library reading format "ml.il.bl" (format: "major.minor.bugfix").
+ * Suppose it is attempting to read a stream whose header says "sml.sil.sbl".
  *
- * Consider a library with version "ml.il.bl" (format: "major.minor.bugfix").
- * Suppose it is attempting to read a chunk serialized by library with version
- * "sml.sil.sbl".
+ * If ml != sml, it can't. Major version changes indicate complete
+ * incompatibilities: an existing encoding has changed.
  *
- * If ml != sml, an error occurs. Major version changes indicate complete
- * incompatibilities. Otherwise:
+ * If il < sil, it can't either. Minor version increments indicate new
+ * features (a header flag, say) which an older library may not be able to
+ * handle.
  *
- * If il < sil, then a "soft" error occurs. Minor version increments indicate
- * new features which an older library may not be able to handle. However, the
- * library can be forced to try anyway, as it may succeed if the new minor
- * version's features were not exercised; hence, a "soft" error.
+ * Otherwise, everything is OK. The bugfix number is reserved for marking
+ * writers whose output needs working around, and is ignored for now.
  *
- * Otherwise, everything is OK, unless "sml.sil.sbl" is known to have buggy
- * serialization, in which case a "soft" error is signalled.
+ * slz_compatible_version applies these rules, and slz_expect_magic raises
+ * SLZ_UNFULFILLED_EXPECTATIONS for a stream they reject.
  *
- * See slz_src_from_file and slz_sink_from_file for information about how errors
- * are signalled.
+ * History (before 0.2.0, the header held the library's version, which these
+ * match):
+ *     0.0.0: the original header, which ends with the version.
+ *     0.1.0: a byte of header flags after the version, with
+ *            SLZ_HEADER_COMPRESSED & SLZ_HEADER_CHECKSUMMED.
+ *     0.2.0: SLZ_HEADER_LITTLE_ENDIAN.
  */
+#define SLZ_FORMAT_VERSION_MAJOR 0
+#define SLZ_FORMAT_VERSION_MINOR 2
+#define SLZ_FORMAT_VERSION_BUGFIX 0
 
 typedef struct { uint16_t major, minor, bugfix; } slz_version_t;
 
 typedef struct slz_src_funcs slz_src_funcs_t;
 typedef struct slz_sink_funcs slz_sink_funcs_t;
+typedef struct slz_stats slz_stats_t;
+typedef struct slz_allocator slz_allocator_t;
+typedef struct slz_intern slz_intern_t;
+
+/* Size of the buffers libslz allocates for sinks and read-ahead sources. */
+#define SLZ_BUFSIZE 8192
 
 typedef struct {
     bool error;
     slz_src_funcs_t *funcs;
     void *obj;
+    /* Read-ahead window. [pos, end) holds bytes read from the underlying
+     * source but not yet decoded. Unless the source manages it itself, it
+     * lives in `buf', which is allocated on first use. */
+    const char *pos, *end;
+    char *buf;
+    size_t bufsize;
+    /* Where `end' is in the stream, ie. how many bytes have come from the
+     * underlying source; see slz_src_tell. */
+    uint64_t offset;
+    bool little_endian;         /* see SLZ_HEADER_LITTLE_ENDIAN */
+    slz_stats_t *stats;         /* see slz_src_set_stats */
+    slz_intern_t *intern;       /* see slz_src_set_intern */
 } slz_src_t;
 
 typedef struct {
     bool error;
     slz_sink_funcs_t *funcs;
     void *obj;
+    /* Write buffer. [buf, pos) holds bytes not yet handed to the underlying
+     * sink; [pos, end) is free space. Allocated on first use. */
+    char *buf, *pos, *end;
+    bool little_endian;         /* see SLZ_HEADER_LITTLE_ENDIAN */
+    slz_stats_t *stats;         /* see slz_sink_set_stats */
+    slz_intern_t *intern;       /* see slz_sink_set_intern */
 } slz_sink_t;
 
 /* Types of errors that can occur. */
@@ -63,7 +95,12 @@ enum slz_state {
     SLZ_BAD_HEADER,
     SLZ_UNFULFILLED_EXPECTATIONS,
     SLZ_OOM,
+    SLZ_MALFORMED,              /* data can't have been written by libslz */
+    SLZ_BAD_CHECKSUM,           /* data corrupted since it was written */
+    SLZ_INCOMPLETE,             /* push source needs more data; see below */
+    SLZ_CANT_SEEK,              /* can't go back that far; see slz_src_seek */
 };
+#define SLZ_NSTATES (SLZ_CANT_SEEK + 1)
 
 typedef uint8_t slz_origin_t;
 enum slz_origin { SLZ_SRC, SLZ_SINK };
@@ -81,6 +118,9 @@ struct slz_ctx {
     /* if this returns, we abort the program. */
     void (*toplevel_error_handler)(slz_ctx_t *ctx, void *userdata);
     void *userdata;
+    slz_stats_t *stats;         /* see slz_ctx_set_stats */
+    bool error_counted;         /* has `state' been counted in `stats'? */
+    const slz_allocator_t *allocator; /* see slz_set_allocator */
 };
 
 /* source and sink vtables */
@@ -95,6 +135,34 @@ struct slz_src_funcs {
     /* Is NOT expected to close the underlying file, if any. We didn't open it,
      * so we don't close it. */
     void (*free)(void *obj);
+    /* Optional. Like read, but may read fewer than `buflen' bytes. Returns the
+     * number of bytes read; 0 indicates EOF or error. Sources that provide it
+     * are read ahead of what has been decoded, SLZ_BUFSIZE bytes at a time;
+     * sources that don't are only ever asked for what is needed.
+     */
+    size_t (*read_some)(void *obj, char *buf, size_t buflen);
+    /* Optional, the counterpart of `flush' in slz_sink_funcs. Sources that
+     * manage their own read-ahead window (eg. because the data is already in
+     * memory) set up src->pos & end and provide this, which is called instead
+     * of read/read_some whenever fewer than `need' bytes are left between
+     * src->pos and src->end. It must make at least `need' bytes available, or
+     * return false, optionally setting ctx->state (SLZ_IO_ERROR is assumed
+     * otherwise). Bytes in [pos, end) must remain in the window, though they
+     * may move. src->buf, if set, is freed on destruction, with slz_free, so
+     * it must come from slz_alloc. src->offset is kept up to date for you,
+     * but a source that sets up a window when it's created sets it to match.
+     */
+    bool (*fill)(slz_ctx_t *ctx, void *obj, slz_src_t *src, size_t need);
+    /* Optional. Moves to stream offset `offset' (see slz_src_tell), which is
+     * outside the read-ahead window, and may be before it. Sources with a
+     * fill hook set up src->pos, end & offset themselves (the window may be
+     * left empty); for the rest, the window has been emptied, src->offset is
+     * where the underlying source is now, and the next read must start at
+     * `offset'. A source that turns out not to be seekable should read its
+     * way forward. On failure, returns false, as fill does. Sources without
+     * this hook are read through when skipping, and can't go back.
+     */
+    bool (*seek)(slz_ctx_t *ctx, void *obj, slz_src_t *src, uint64_t offset);
 };
 
 struct slz_sink_funcs {
@@ -102,11 +170,26 @@ struct slz_sink_funcs {
     /* As strerror in slz_src_funcs. */
     size_t (*strerror)(void *obj, char *buf, size_t buflen);
     void (*free)(void *obj);
+    /* Optional. Sinks that leave this NULL get a write buffer managed by
+     * libslz, which is emptied with `write'. Sinks that want to manage the
+     * buffer themselves (eg. to serialize straight into their own storage)
+     * set up sink->buf, pos & end and provide this, which is called instead
+     * of `write' whenever the buffer is full, and by slz_sink_flush (with
+     * `need' 0). It may do what it likes with the bytes in [buf, pos), but
+     * must leave at least `need' bytes free between sink->pos and sink->end.
+     * On failure it returns false, optionally setting ctx->state (SLZ_IO_ERROR
+     * is assumed otherwise). Either way, sink->buf is freed on destruction,
+     * as src->buf is.
+     */
+    bool (*flush)(slz_ctx_t *ctx, void *obj, slz_sink_t *sink, size_t need);
 };
 
 
 /* Miscellany. */
 slz_version_t slz_version(void);
+/* The format version this library writes. */
+slz_version_t slz_format_version(void);
+/* Whether this library can read a stream of format `version'. */
 bool slz_compatible_version(slz_version_t version);
 
 
@@ -125,7 +208,8 @@ static inline bool slz_ok(slz_ctx_t *ctx) {
 }
 
 /* Precondition: !slz_ok(ctx).
- * NB. doesn't clear the error from src or sink that caused it.
+ * NB. doesn't clear the error from src or sink that caused it; see
+ * slz_src_clear_error and slz_sink_clear_error.
  */
 void slz_clear_error(slz_ctx_t *ctx);
 /* Precondition: !slz_ok(ctx). */
@@ -158,6 +242,87 @@ static inline slz_ctx_t *slz_PRIVATE_pre_catch(slz_ctx_t *ctx) {
     return ctx;
 }
 
+
+/* Memory allocation.
+ *
+ * Everything libslz allocates comes from the context's allocator: the malloc
+ * family unless you set another. Sources and sinks keep using the allocator
+ * of the context they were created with, so must only be used with contexts
+ * that have the same one; so must arenas. The parallel container functions
+ * use it from several threads at once.
+ */
+struct slz_allocator {
+    /* Returns memory for `size' bytes (never 0), aligned to `align' (a power
+     * of two, at most 4096), or NULL on failure. */
+    void *(*alloc)(void *userdata, size_t size, size_t align);
+    void (*free)(void *userdata, void *ptr);
+    void *userdata;
+};
+
+/* `allocator' (NULL for the default) must outlive everything allocated with
+ * it. Set it before creating any sources, sinks or arenas. */
+void slz_set_allocator(slz_ctx_t *ctx, const slz_allocator_t *allocator);
+
+/* Allocate & free as libslz does. slz_alloc raises SLZ_OOM on failure. Memory
+ * is aligned suitably for any basic type. */
+void *slz_alloc(slz_ctx_t *ctx, size_t size);
+void slz_free(slz_ctx_t *ctx, void *ptr);
+
+
+/* Statistics.
+ *
+ * Counters of what goes on between libslz and the underlying sources and
+ * sinks: the calls made to their vtables ("transport calls"), the bytes
+ * those moved, and how long they took. They're kept in an slz_stats_t of
+ * your own, attached to a context, a source or a sink; nothing is counted
+ * unless one is. A context counts the transport calls of every source and
+ * sink used with it (so stacked ones, like slz_sink_compress over a file,
+ * count at each level) and every error raised, or absorbed by the sticky
+ * API (see below); a source or sink counts its own calls, and those that
+ * failed. Several may share an slz_stats_t, but not across threads.
+ *
+ * Timing a call costs a couple of clock reads, on top of a check whether
+ * anyone is counting for every call. Building libslz with STATS=no (ie.
+ * -DSLZ_NO_STATS) compiles all of it out; the functions below remain, but
+ * nothing is ever counted.
+ */
+enum slz_stats_call {
+    SLZ_CALL_READ,
+    SLZ_CALL_READ_SOME,
+    SLZ_CALL_FILL,
+    SLZ_CALL_SEEK,
+    SLZ_CALL_WRITE,
+    SLZ_CALL_FLUSH,
+    SLZ_NCALLS
+};
+
+/* Latency bucket b counts calls that took [2^b, 2^(b+1)) nanoseconds (the
+ * first also counts those under 1ns, the last everything longer). */
+#define SLZ_STATS_NBUCKETS 40
+
+struct slz_stats {
+    uint64_t bytes_in;          /* by read, read_some & fill */
+    uint64_t bytes_out;         /* by write & flush */
+    uint64_t calls[SLZ_NCALLS];
+    uint64_t flushes;           /* slz_sink_flush & slz_sink_try_flush */
+    uint64_t errors[SLZ_NSTATES];
+    uint64_t latency[SLZ_STATS_NBUCKETS];
+};
+
+/* Attach `stats' (or detach, with NULL); it must outlive the attachment. The
+ * counters aren't zeroed. */
+void slz_ctx_set_stats(slz_ctx_t *ctx, slz_stats_t *stats);
+void slz_src_set_stats(slz_src_t *src, slz_stats_t *stats);
+void slz_sink_set_stats(slz_sink_t *sink, slz_stats_t *stats);
+
+void slz_stats_reset(slz_stats_t *stats);
+/* Copies `stats' to `out', then zeroes it if `reset', so that a scraper can
+ * collect deltas. */
+void slz_stats_snapshot(slz_stats_t *stats, slz_stats_t *out, bool reset);
+/* Adds the counters in `from' to those in `into'; eg. to total up the stats
+ * of several threads' contexts. */
+void slz_stats_add(slz_stats_t *into, const slz_stats_t *from);
+
 
 /* Sources & sinks. */
 void slz_src_init(
@@ -165,52 +330,1128 @@ void slz_src_init(
 void slz_sink_init(
     slz_ctx_t *ctx, slz_sink_t *src, slz_sink_funcs_t *funcs, void *obj);
 
+/* Point an existing source or sink at a new transport, as if it had been
+ * destroyed and created afresh, but keeping its buffers (and stats, and
+ * string table, which isn't reset). The old transport is freed, unless `obj'
+ * is the old object; like destruction, this doesn't flush, and errors are
+ * cleared.
+ *
+ * The slz_*_reset_* functions below do the same for a built-in transport:
+ * when `src' or `sink' is already one of that kind, they reuse its state too,
+ * so that a stream of short messages needs no allocations at all.
+ */
+void slz_src_reset(
+    slz_ctx_t *ctx, slz_src_t *src, slz_src_funcs_t *funcs, void *obj);
+void slz_sink_reset(
+    slz_ctx_t *ctx, slz_sink_t *sink, slz_sink_funcs_t *funcs, void *obj);
+
+/* NB. Reading from `src' reads ahead in `file', so once you're done with
+ * `src', `file's position is unspecified. */
 void slz_src_from_file(slz_ctx_t *ctx, slz_src_t *src, FILE *file);
 void slz_sink_from_file(slz_ctx_t *ctx, slz_sink_t *sink, FILE *file);
+void slz_src_reset_file(slz_ctx_t *ctx, slz_src_t *src, FILE *file);
+void slz_sink_reset_file(slz_ctx_t *ctx, slz_sink_t *sink, FILE *file);
+
+/* Reads from the `len' bytes at `data', which are not copied and must outlive
+ * `src'. Running out of data is an SLZ_IO_ERROR, as for files. */
+void slz_src_from_memory(
+    slz_ctx_t *ctx, slz_src_t *src, const char *data, size_t len);
+void slz_src_reset_memory(
+    slz_ctx_t *ctx, slz_src_t *src, const char *data, size_t len);
+
+/* Flags for the mmap sources, which may be or'ed together. The first two are
+ * passed along to madvise. SLZ_MMAP_HUGEPAGE maps the file at an address
+ * aligned for huge pages, and asks for them where the OS supports that. */
+enum slz_mmap_flags {
+    SLZ_MMAP_SEQUENTIAL = 1 << 0,
+    SLZ_MMAP_WILLNEED = 1 << 1,
+    SLZ_MMAP_HUGEPAGE = 1 << 2,
+};
+
+/* Reads from a read-only memory mapping of the file at `path', or of `fd'
+ * (which we don't close). Values are decoded straight from the mapping, and
+ * slz_get_bytes_view returns pointers into it, which are good until `src' is
+ * destroyed. Failing to open or map the file is an SLZ_IO_ERROR with `src' as
+ * its origin; `src' must still be destroyed afterwards.
+ */
+void slz_src_from_path(
+    slz_ctx_t *ctx, slz_src_t *src, const char *path, unsigned flags);
+void slz_src_from_fd_mmap(
+    slz_ctx_t *ctx, slz_src_t *src, int fd, unsigned flags);
+
+/* Flags for the fd transports, which may be or'ed together. The first two are
+ * passed along to posix_fadvise for the whole file; SLZ_FD_DONTNEED drops
+ * what's been read or written from the page cache as we go. SLZ_FD_DIRECT
+ * asks for O_DIRECT I/O, bypassing the page cache, where the OS and the file
+ * system support it, and is quietly ignored where they don't. */
+enum slz_fd_flags {
+    SLZ_FD_SEQUENTIAL = 1 << 0,
+    SLZ_FD_WILLNEED = 1 << 1,
+    SLZ_FD_DONTNEED = 1 << 2,
+    SLZ_FD_DIRECT = 1 << 3,
+};
+
+/* Read from or write to `fd' (which we don't close) with read & write, or,
+ * for seekable fds, pread & pwrite, through aligned buffers of our own.
+ *
+ * A source from a seekable fd reads from its current offset, but doesn't move
+ * it. A sink writes at the fd's offset, and leaves it after what's been
+ * flushed. In O_DIRECT mode, the sink needs the fd to start at an offset
+ * that's a multiple of 4096 (otherwise it doesn't use O_DIRECT), and each
+ * slz_sink_flush writes the last, partial block without O_DIRECT, only to
+ * rewrite it once it's full; so flush seldom. SLZ_FD_DIRECT sets O_DIRECT on
+ * the open file description, which other fds may share, until the source or
+ * sink is destroyed.
+ */
+void slz_src_from_fd(slz_ctx_t *ctx, slz_src_t *src, int fd, unsigned flags);
+void slz_sink_from_fd(slz_ctx_t *ctx, slz_sink_t *sink, int fd, unsigned flags);
+void slz_src_reset_fd(slz_ctx_t *ctx, slz_src_t *src, int fd, unsigned flags);
+void slz_sink_reset_fd(
+    slz_ctx_t *ctx, slz_sink_t *sink, int fd, unsigned flags);
+
+/* Writes to `fd' (which we don't close) from a background thread, so that
+ * serializing and writing overlap. The sink has `nbufs' buffers of `bufsize'
+ * bytes (0 for defaults: 4 buffers of 1MB). While the I/O thread is writing
+ * one, the rest can be filled; once they all have been, puts wait for the I/O
+ * thread, so nbufs * bufsize bounds how far ahead of the disk serialization
+ * can get. slz_sink_flush waits for everything to be written.
+ *
+ * A failed write is an SLZ_IO_ERROR from the next put that needs a fresh
+ * buffer, or from slz_sink_flush, whichever comes first; nothing more is
+ * written after it. Destroying the sink waits for buffers already handed to
+ * the I/O thread to be written, but, as ever, doesn't flush.
+ */
+void slz_sink_async_fd(slz_ctx_t *ctx, slz_sink_t *sink, int fd,
+                       size_t nbufs, size_t bufsize);
+
+/* Writes to `fd' (which we don't close) with writev, so that slz_put_bytes_ref
+ * can send large values from the caller's memory without copying them. */
+void slz_sink_gather_fd(slz_ctx_t *ctx, slz_sink_t *sink, int fd);
+
+/* Serializes into a buffer in memory, which grows as needed. Resetting a
+ * memory sink empties it, keeping the buffer. */
+void slz_sink_to_memory(slz_ctx_t *ctx, slz_sink_t *sink);
+void slz_sink_reset_memory(slz_ctx_t *ctx, slz_sink_t *sink);
+
+/* Takes over the buffer of a memory sink, storing the number of bytes written
+ * to it in *len. The caller must slz_free() it (or free() it, if the
+ * context's allocator is the default). Afterwards the sink is empty, and can
+ * be written to again. Returns NULL if nothing has been written yet.
+ */
+char *slz_sink_memory_release(slz_ctx_t *ctx, slz_sink_t *sink, size_t *len);
+
+/* Push sources, for decoding data as it arrives, say from a non-blocking
+ * socket, without blocking for the rest of a message.
+ *
+ * You push bytes in as you get them, and decode as usual. Running out is
+ * SLZ_INCOMPLETE, rather than an error from the source: clear it, call
+ * slz_src_push_rewind, which goes back to the last mark and says how many
+ * more bytes are needed at least, and try again from there once they've been
+ * pushed. Bytes from the mark on are kept, so nothing has to be read twice;
+ * marking after each message (or any point it's worth resuming from) lets
+ * those before go. An attached string table (see slz_src_set_intern) goes
+ * back to how it was at the mark too, so reset it, if at all, only just
+ * after marking. With the sticky API, that's
+ *
+ *     slz_src_push_bytes(&ctx, &src, n, data);
+ *     for (;;) {
+ *         msg.id = slz_try_get_uint32(&ctx, &src);
+ *         msg.len = slz_try_get_varuint(&ctx, &src);
+ *         ...
+ *         if (!slz_ok(&ctx))
+ *             break;
+ *         handle(&msg);
+ *         slz_src_push_mark(&src);
+ *     }
+ *     if (ctx.state != SLZ_INCOMPLETE)
+ *         ...;                    // a real error
+ *     slz_clear_error(&ctx);
+ *     need = slz_src_push_rewind(&src);
+ *
+ * src->pos == src->end when everything pushed has been decoded. Instead of
+ * copying with slz_src_push_bytes, you can receive straight into the source:
+ * slz_src_push_reserve returns room for `len' bytes, of which you then push
+ * the first `n' with slz_src_push_commit. Both raise SLZ_OOM on failure.
+ */
+void slz_src_push(slz_ctx_t *ctx, slz_src_t *src);
+void slz_src_reset_push(slz_ctx_t *ctx, slz_src_t *src);
+void slz_src_push_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, const char *data);
+char *slz_src_push_reserve(slz_ctx_t *ctx, slz_src_t *src, size_t len);
+void slz_src_push_commit(slz_src_t *src, size_t n);
+void slz_src_push_mark(slz_src_t *src);
+size_t slz_src_push_rewind(slz_src_t *src);
+
+/* Compresses what's written to `sink', in blocks of up to 64K, and writes it
+ * to `inner'; slz_src_decompress undoes it. The codec is a simple LZ77, built
+ * to decompress at memory speed rather than to compress well. `inner' must
+ * outlive `sink', which doesn't own it. Flushing `sink' flushes `inner' too.
+ *
+ * To say that the rest of a stream is compressed, write its header with
+ * SLZ_HEADER_COMPRESSED:
+ *
+ *     slz_put_magic_flags(&ctx, &file_sink, SLZ_HEADER_COMPRESSED);
+ *     slz_sink_compress(&ctx, &sink, &file_sink);
+ *
+ *     unsigned flags;
+ *     slz_get_magic_flags(&ctx, &file_src, &flags);
+ *     if (flags & SLZ_HEADER_COMPRESSED)
+ *         slz_src_decompress(&ctx, &src, &file_src);
+ *
+ * A block that doesn't decompress is SLZ_MALFORMED; errors from `inner' are
+ * reported as errors from `sink' or `src'.
+ */
+void slz_sink_compress(slz_ctx_t *ctx, slz_sink_t *sink, slz_sink_t *inner);
+void slz_src_decompress(slz_ctx_t *ctx, slz_src_t *src, slz_src_t *inner);
 
+/* Cuts what's written to `sink' into blocks of up to 64K, and writes each to
+ * `inner' with its CRC32C; slz_src_verify checks them as they're read, and
+ * raises SLZ_BAD_CHECKSUM for a block that doesn't match. Otherwise these are
+ * like slz_sink_compress & slz_src_decompress, and the header flag is
+ * SLZ_HEADER_CHECKSUMMED. To both compress and checksum, checksum the
+ * compressed data, so that corruption is caught before decompressing it:
+ *
+ *     slz_put_magic_flags(&ctx, &file_sink,
+ *                         SLZ_HEADER_COMPRESSED | SLZ_HEADER_CHECKSUMMED);
+ *     slz_sink_checksum(&ctx, &checked, &file_sink);
+ *     slz_sink_compress(&ctx, &sink, &checked);
+ */
+void slz_sink_checksum(slz_ctx_t *ctx, slz_sink_t *sink, slz_sink_t *inner);
+void slz_src_verify(slz_ctx_t *ctx, slz_src_t *src, slz_src_t *inner);
+
+/* Returns the CRC32C of the `len' bytes at `data', continuing from `crc',
+ * which is 0 to start with. Uses SSE4.2 where the CPU has it. */
+uint32_t slz_crc32c(uint32_t crc, const void *data, size_t len);
+
+/* Does NOT flush the sink; use slz_sink_flush for that. Any bytes a source
+ * has read ahead are lost. */
 void slz_src_destroy(slz_ctx_t *ctx, slz_src_t *sink);
 void slz_sink_destroy(slz_ctx_t *ctx, slz_sink_t *sink);
 
+/* Hands everything written to `sink' so far to the underlying sink. Output is
+ * buffered, so until this is called, there's no telling how much of it has
+ * reached the underlying sink (or whether writing it has failed).
+ */
+void slz_sink_flush(slz_ctx_t *ctx, slz_sink_t *sink);
+
+/* INTERNAL FUNCTION DO NOT USE. */
+void slz_PRIVATE_sink_make_room(slz_ctx_t *ctx, slz_sink_t *sink, size_t len);
+
+/* Ensures there are at least `len' bytes of free space in `sink's write
+ * buffer, and returns a pointer to them. The caller may then fill them in
+ * directly, and must advance sink->pos past whatever it has filled in.
+ */
+static inline char *slz_sink_reserve(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len)
+{
+    if ((size_t) (sink->end - sink->pos) < len)
+        slz_PRIVATE_sink_make_room(ctx, sink, len);
+    return sink->pos;
+}
+
+/* INTERNAL FUNCTION DO NOT USE. */
+void slz_PRIVATE_src_fill(slz_ctx_t *ctx, slz_src_t *src, size_t len);
+
+/* Ensures at least `len' bytes are available in `src's read-ahead window and
+ * returns a pointer to them, without consuming them. To consume them, advance
+ * src->pos.
+ */
+static inline const char *slz_src_peek(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    if ((size_t) (src->end - src->pos) < len)
+        slz_PRIVATE_src_fill(ctx, src, len);
+    return src->pos;
+}
+
+/* Ensures the next `len' bytes can be decoded with the *_unchecked getters.
+ * Example:
+ *
+ *     slz_src_reserve(&ctx, &src, 4 + 8);
+ *     uint32_t id = slz_get_uint32_unchecked(&src);
+ *     int64_t stamp = slz_get_int64_unchecked(&src);
+ */
+static inline void slz_src_reserve(slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    (void) slz_src_peek(ctx, src, len);
+}
+
+
+/* Arenas.
+ *
+ * An arena hands out memory from big chunks, and frees it all at once. Use
+ * one to hold the strings & blobs of a deserialized message, rather than
+ * malloc'ing each separately. Running out of memory is SLZ_OOM, raised as
+ * usual.
+ */
+typedef struct slz_arena_chunk slz_arena_chunk_t;
+
+typedef struct {
+    slz_arena_chunk_t *chunks;
+    char *pos, *end;
+    size_t chunk_size;
+    const slz_allocator_t *allocator; /* of the contexts it's used with */
+} slz_arena_t;
+
+/* `chunk_size' is the size of the first chunk; 0 picks a default. Later
+ * chunks grow. Doesn't allocate anything. */
+void slz_arena_init(slz_arena_t *arena, size_t chunk_size);
+/* Memory is aligned suitably for any basic type. */
+void *slz_arena_alloc(slz_ctx_t *ctx, slz_arena_t *arena, size_t size);
+/* Frees everything allocated from `arena', but keeps its current chunk for
+ * reuse. */
+void slz_arena_reset(slz_arena_t *arena);
+/* Frees everything; the arena can still be used afterwards. */
+void slz_arena_free(slz_arena_t *arena);
+
 
 /* Serialization. */
-void slz_put_bytes(
+/* INTERNAL FUNCTION DO NOT USE. */
+void slz_PRIVATE_put_bytes(
     slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data);
 
+static inline void slz_put_bytes(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
+{
+    if ((size_t) (sink->end - sink->pos) < len) {
+        slz_PRIVATE_put_bytes(ctx, sink, len, data);
+        return;
+    }
+    memcpy(sink->pos, data, len);
+    sink->pos += len;
+}
+
+/* As slz_put_bytes, but on sinks from slz_sink_gather_fd, large values are
+ * referenced rather than copied: `data' must stay alive and unchanged until
+ * the next slz_sink_flush returns. On other sinks (or for small values),
+ * this is just slz_put_bytes. */
+void slz_put_bytes_ref(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data);
+
+/* The header is a magic number, the format version, and (from format 0.1.0
+ * on; see the top of this file) a byte of flags saying how what follows is
+ * encoded. Older headers read as having no flags.
+ *
+ * SLZ_HEADER_LITTLE_ENDIAN says that the multi-byte integers (and floats,
+ * and the plain arrays of either) that follow are little-endian, so that on
+ * little-endian hosts, putting & getting them is a plain memcpy with no byte
+ * swapping. Putting the header sets the order of `sink', and getting it sets
+ * that of `src', so nothing else changes for the caller; sinks & sources
+ * layered over them (see slz_sink_compress) take on their order when they're
+ * created, so put & get the header first. Varints, blobs, the byte-shuffled
+ * arrays and record batches are the same either way, as is the framing of
+ * compressed, checksummed & container streams, which is always big-endian.
+ * Readers handle both orders on any host.
+ */
+enum slz_header_flags {
+    SLZ_HEADER_COMPRESSED = 1 << 0, /* see slz_sink_compress */
+    SLZ_HEADER_CHECKSUMMED = 1 << 1, /* see slz_sink_checksum */
+    SLZ_HEADER_LITTLE_ENDIAN = 1 << 2,
+    SLZ_HEADER_KNOWN_FLAGS = (1 << 3) - 1
+};
+
 void slz_put_magic(slz_ctx_t *ctx, slz_sink_t *sink);
+/* As slz_put_magic, with `flags' from enum slz_header_flags. */
+void slz_put_magic_flags(slz_ctx_t *ctx, slz_sink_t *sink, unsigned flags);
+
+/* INTERNAL FUNCTIONS DO NOT USE. Store & load a value in either byte order.
+ * Where we know the host's, that's a memcpy, with a byte swap first if the
+ * orders differ. */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+#define SLZ_PRIVATE_HOST_LITTLE_ENDIAN \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SLZ_PRIVATE_DEFINE_ORDER(bits)                                  \
+    static inline void slz_PRIVATE_store##bits(                         \
+        char *p, uint##bits##_t val, bool little_endian)                \
+    {                                                                   \
+        if (little_endian != SLZ_PRIVATE_HOST_LITTLE_ENDIAN)            \
+            val = __builtin_bswap##bits(val);                           \
+        memcpy(p, &val, sizeof val);                                    \
+    }                                                                   \
+    static inline uint##bits##_t slz_PRIVATE_load##bits(                \
+        const char *p, bool little_endian)                              \
+    {                                                                   \
+        uint##bits##_t val;                                             \
+        memcpy(&val, p, sizeof val);                                    \
+        return little_endian != SLZ_PRIVATE_HOST_LITTLE_ENDIAN          \
+            ? __builtin_bswap##bits(val) : val;                         \
+    }
+#else
+#define SLZ_PRIVATE_DEFINE_ORDER(bits)                                  \
+    static inline void slz_PRIVATE_store##bits(                         \
+        char *p, uint##bits##_t val, bool little_endian)                \
+    {                                                                   \
+        for (unsigned i = 0; i < bits / 8; ++i)                         \
+            p[little_endian ? i : bits / 8 - 1 - i] =                   \
+                (char) (unsigned char) (val >> (8 * i));                \
+    }                                                                   \
+    static inline uint##bits##_t slz_PRIVATE_load##bits(                \
+        const char *p, bool little_endian)                              \
+    {                                                                   \
+        uint##bits##_t val = 0;                                         \
+        for (unsigned i = 0; i < bits / 8; ++i)                         \
+            val |= (uint##bits##_t) (unsigned char)                     \
+                p[little_endian ? i : bits / 8 - 1 - i] << (8 * i);     \
+        return val;                                                     \
+    }
+#endif
+
+SLZ_PRIVATE_DEFINE_ORDER(16)
+SLZ_PRIVATE_DEFINE_ORDER(32)
+SLZ_PRIVATE_DEFINE_ORDER(64)
+
+/* The fixed-width puts store straight into the write buffer; only when it is
+ * full do they call out of line. Multi-byte integers are big-endian, unless
+ * the header said otherwise (see SLZ_HEADER_LITTLE_ENDIAN).
+ *
+ * The *_unchecked variants skip the check. Use them only on space you've
+ * already got from slz_sink_reserve.
+ */
+static inline void slz_put_uint8_unchecked(slz_sink_t *sink, uint8_t val) {
+    *sink->pos++ = (char) val;
+}
+
+#define SLZ_PRIVATE_DEFINE_PUT_UNCHECKED(bits)                          \
+    static inline void slz_put_uint##bits##_unchecked(                  \
+        slz_sink_t *sink, uint##bits##_t val)                           \
+    {                                                                   \
+        slz_PRIVATE_store##bits(sink->pos, val, sink->little_endian);   \
+        sink->pos += bits / 8;                                          \
+    }
+
+SLZ_PRIVATE_DEFINE_PUT_UNCHECKED(16)
+SLZ_PRIVATE_DEFINE_PUT_UNCHECKED(32)
+SLZ_PRIVATE_DEFINE_PUT_UNCHECKED(64)
+
+static inline void slz_put_bool_unchecked(slz_sink_t *sink, bool val) {
+    slz_put_uint8_unchecked(sink, val ? 1 : 0);
+}
+static inline void slz_put_int8_unchecked(slz_sink_t *sink, int8_t val) {
+    slz_put_uint8_unchecked(sink, (uint8_t) val);
+}
+static inline void slz_put_int16_unchecked(slz_sink_t *sink, int16_t val) {
+    slz_put_uint16_unchecked(sink, (uint16_t) val);
+}
+static inline void slz_put_int32_unchecked(slz_sink_t *sink, int32_t val) {
+    slz_put_uint32_unchecked(sink, (uint32_t) val);
+}
+static inline void slz_put_int64_unchecked(slz_sink_t *sink, int64_t val) {
+    slz_put_uint64_unchecked(sink, (uint64_t) val);
+}
+
+/* Floats & doubles (IEEE-754 single & double precision) are stored as their
+ * bit patterns, as a uint32 or uint64 would be. */
+static inline void slz_put_float_unchecked(slz_sink_t *sink, float val)
+{
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof bits);
+    slz_put_uint32_unchecked(sink, bits);
+}
+
+static inline void slz_put_double_unchecked(slz_sink_t *sink, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof bits);
+    slz_put_uint64_unchecked(sink, bits);
+}
+
+#define SLZ_PRIVATE_DEFINE_PUT(name, type, size)                        \
+    static inline void slz_put_##name(                                  \
+        slz_ctx_t *ctx, slz_sink_t *sink, type val)                     \
+    {                                                                   \
+        slz_sink_reserve(ctx, sink, size);                              \
+        slz_put_##name##_unchecked(sink, val);                          \
+    }
+
+SLZ_PRIVATE_DEFINE_PUT(bool,       bool, 1)
+SLZ_PRIVATE_DEFINE_PUT(uint8,   uint8_t, 1)
+SLZ_PRIVATE_DEFINE_PUT(int8,     int8_t, 1)
+SLZ_PRIVATE_DEFINE_PUT(uint16, uint16_t, 2)
+SLZ_PRIVATE_DEFINE_PUT(int16,   int16_t, 2)
+SLZ_PRIVATE_DEFINE_PUT(uint32, uint32_t, 4)
+SLZ_PRIVATE_DEFINE_PUT(int32,   int32_t, 4)
+SLZ_PRIVATE_DEFINE_PUT(uint64, uint64_t, 8)
+SLZ_PRIVATE_DEFINE_PUT(int64,   int64_t, 8)
+SLZ_PRIVATE_DEFINE_PUT(float,     float, 4)
+SLZ_PRIVATE_DEFINE_PUT(double,   double, 8)
+
+/* Puts `n' values one after another, encoded exactly as n calls to the
+ * corresponding single-value put would, but a block at a time. The number of
+ * values is not written; put it first if the reader won't know it. */
+void slz_put_uint16_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const uint16_t *vals);
+void slz_put_int16_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const int16_t *vals);
+void slz_put_uint32_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const uint32_t *vals);
+void slz_put_int32_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const int32_t *vals);
+void slz_put_uint64_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const uint64_t *vals);
+void slz_put_int64_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const int64_t *vals);
+void slz_put_float_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const float *vals);
+void slz_put_double_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const double *vals);
+
+/* Like slz_put_float_array & slz_put_double_array, but byte-shuffled: each
+ * block of up to 1024 values is stored a byte plane at a time, all their
+ * first (most significant) bytes, then all their second bytes, and so on.
+ * Neighbouring values in a series tend to share their sign, exponent & top
+ * bits of mantissa, so this gathers those into long runs that compress well
+ * (see slz_sink_compress), while the noisy low bytes end up out of the way.
+ * It's only a different layout, as cheap as the plain one; read it back with
+ * the corresponding shuffled get.
+ */
+void slz_put_float_array_shuffled(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const float *vals);
+void slz_put_double_array_shuffled(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const double *vals);
+
+/* Variable-length integers: LEB128, taking between 1 and SLZ_VARINT_MAX
+ * bytes, depending on magnitude. slz_put_varint zigzag-encodes its argument,
+ * so small negative values are short too. */
+#define SLZ_VARINT_MAX 10
+
+static inline void slz_put_varuint(
+    slz_ctx_t *ctx, slz_sink_t *sink, uint64_t val)
+{
+    unsigned char *p =
+        (unsigned char*) slz_sink_reserve(ctx, sink, SLZ_VARINT_MAX);
+    while (val >= 0x80) {
+        *p++ = (unsigned char) (val | 0x80);
+        val >>= 7;
+    }
+    *p++ = (unsigned char) val;
+    sink->pos = (char*) p;
+}
+
+static inline void slz_put_varint(
+    slz_ctx_t *ctx, slz_sink_t *sink, int64_t val)
+{
+    slz_put_varuint(ctx, sink, ((uint64_t) val << 1) ^ -((uint64_t) val >> 63));
+}
 
-void slz_put_bool  (slz_ctx_t *ctx, slz_sink_t *sink,     bool val);
-void slz_put_uint8 (slz_ctx_t *ctx, slz_sink_t *sink,  uint8_t val);
-void slz_put_int8  (slz_ctx_t *ctx, slz_sink_t *sink,   int8_t val);
-void slz_put_uint16(slz_ctx_t *ctx, slz_sink_t *sink, uint16_t val);
-void slz_put_int16 (slz_ctx_t *ctx, slz_sink_t *sink,  int16_t val);
-void slz_put_uint32(slz_ctx_t *ctx, slz_sink_t *sink, uint32_t val);
-void slz_put_int32 (slz_ctx_t *ctx, slz_sink_t *sink,  int32_t val);
-void slz_put_uint64(slz_ctx_t *ctx, slz_sink_t *sink, uint64_t val);
-void slz_put_int64 (slz_ctx_t *ctx, slz_sink_t *sink,  int64_t val);
+/* Bulk forms for 32-bit values. These use a different encoding from the
+ * single-value forms (see slz_varint.c), designed for fast decoding; the
+ * number of values is not written. */
+void slz_put_varuint32_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const uint32_t *vals);
+void slz_put_varint32_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const int32_t *vals);
+
+/* Blobs: a varuint length, then that many bytes. */
+void slz_put_blob(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data);
+/* Puts the string without its null terminator, as a blob. */
+void slz_put_str(slz_ctx_t *ctx, slz_sink_t *sink, const char *str);
 
 
 /* Deserialization. */
-void slz_get_bytes(slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out);
-
-    bool slz_get_bool  (slz_ctx_t *ctx, slz_src_t *src);
- uint8_t slz_get_uint8 (slz_ctx_t *ctx, slz_src_t *src);
-  int8_t slz_get_int8  (slz_ctx_t *ctx, slz_src_t *src);
-uint16_t slz_get_uint16(slz_ctx_t *ctx, slz_src_t *src);
- int16_t slz_get_int16 (slz_ctx_t *ctx, slz_src_t *src);
-uint32_t slz_get_uint32(slz_ctx_t *ctx, slz_src_t *src);
- int32_t slz_get_int32 (slz_ctx_t *ctx, slz_src_t *src);
-uint64_t slz_get_uint64(slz_ctx_t *ctx, slz_src_t *src);
- int64_t slz_get_int64 (slz_ctx_t *ctx, slz_src_t *src);
+/* INTERNAL FUNCTION DO NOT USE. */
+void slz_PRIVATE_get_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out);
+
+static inline void slz_get_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out)
+{
+    if ((size_t) (src->end - src->pos) < len) {
+        slz_PRIVATE_get_bytes(ctx, src, len, out);
+        return;
+    }
+    memcpy(out, src->pos, len);
+    src->pos += len;
+}
+
+/* The position of `src' in its stream: how many bytes have been got or
+ * skipped since it was created (or reset). */
+static inline uint64_t slz_src_tell(const slz_src_t *src) {
+    return src->offset - (uint64_t) (src->end - src->pos);
+}
+
+/* INTERNAL FUNCTION DO NOT USE. */
+void slz_PRIVATE_skip_bytes(slz_ctx_t *ctx, slz_src_t *src, uint64_t len);
+
+/* Skips `len' bytes: by seeking past them if the source has a seek hook
+ * (file, fd & path sources do), and by reading through them otherwise. */
+static inline void slz_skip_bytes(slz_ctx_t *ctx, slz_src_t *src, uint64_t len)
+{
+    if ((uint64_t) (src->end - src->pos) < len) {
+        slz_PRIVATE_skip_bytes(ctx, src, len);
+        return;
+    }
+    src->pos += len;
+}
+
+/* Goes to `offset', as given by slz_src_tell. Going back further than the
+ * read-ahead window needs a seek hook, and for file & fd sources, a file that
+ * can be seeked in (not a pipe). Without a hook, it's SLZ_CANT_SEEK. */
+void slz_src_seek(slz_ctx_t *ctx, slz_src_t *src, uint64_t offset);
+
+/* Like the puts, the fixed-width gets decode straight from the read-ahead
+ * window, and the *_unchecked variants may only be used on bytes already
+ * secured with slz_src_reserve. */
+static inline uint8_t slz_get_uint8_unchecked(slz_src_t *src) {
+    return (uint8_t) *src->pos++;
+}
+
+#define SLZ_PRIVATE_DEFINE_GET_UNCHECKED(bits)                          \
+    static inline uint##bits##_t slz_get_uint##bits##_unchecked(        \
+        slz_src_t *src)                                                 \
+    {                                                                   \
+        const char *p = src->pos;                                       \
+        src->pos += bits / 8;                                           \
+        return slz_PRIVATE_load##bits(p, src->little_endian);           \
+    }
+
+SLZ_PRIVATE_DEFINE_GET_UNCHECKED(16)
+SLZ_PRIVATE_DEFINE_GET_UNCHECKED(32)
+SLZ_PRIVATE_DEFINE_GET_UNCHECKED(64)
+
+static inline bool slz_get_bool_unchecked(slz_src_t *src) {
+    return slz_get_uint8_unchecked(src) ? true : false;
+}
+static inline int8_t slz_get_int8_unchecked(slz_src_t *src) {
+    return (int8_t) slz_get_uint8_unchecked(src);
+}
+static inline int16_t slz_get_int16_unchecked(slz_src_t *src) {
+    return (int16_t) slz_get_uint16_unchecked(src);
+}
+static inline int32_t slz_get_int32_unchecked(slz_src_t *src) {
+    return (int32_t) slz_get_uint32_unchecked(src);
+}
+static inline int64_t slz_get_int64_unchecked(slz_src_t *src) {
+    return (int64_t) slz_get_uint64_unchecked(src);
+}
+
+static inline float slz_get_float_unchecked(slz_src_t *src)
+{
+    uint32_t bits = slz_get_uint32_unchecked(src);
+    float val;
+    memcpy(&val, &bits, sizeof val);
+    return val;
+}
+
+static inline double slz_get_double_unchecked(slz_src_t *src)
+{
+    uint64_t bits = slz_get_uint64_unchecked(src);
+    double val;
+    memcpy(&val, &bits, sizeof val);
+    return val;
+}
+
+#define SLZ_PRIVATE_DEFINE_GET(name, type, size)                        \
+    static inline type slz_get_##name(slz_ctx_t *ctx, slz_src_t *src)   \
+    {                                                                   \
+        slz_src_reserve(ctx, src, size);                                \
+        return slz_get_##name##_unchecked(src);                         \
+    }
+
+SLZ_PRIVATE_DEFINE_GET(bool,       bool, 1)
+SLZ_PRIVATE_DEFINE_GET(uint8,   uint8_t, 1)
+SLZ_PRIVATE_DEFINE_GET(int8,     int8_t, 1)
+SLZ_PRIVATE_DEFINE_GET(uint16, uint16_t, 2)
+SLZ_PRIVATE_DEFINE_GET(int16,   int16_t, 2)
+SLZ_PRIVATE_DEFINE_GET(uint32, uint32_t, 4)
+SLZ_PRIVATE_DEFINE_GET(int32,   int32_t, 4)
+SLZ_PRIVATE_DEFINE_GET(uint64, uint64_t, 8)
+SLZ_PRIVATE_DEFINE_GET(int64,   int64_t, 8)
+SLZ_PRIVATE_DEFINE_GET(float,     float, 4)
+SLZ_PRIVATE_DEFINE_GET(double,   double, 8)
+
+/* Like slz_get_bytes, but instead of copying the bytes out, returns a pointer
+ * to them. For sources from slz_src_from_memory, this points into the caller's
+ * data; for mmap sources, into the mapping; otherwise, it points into the
+ * read-ahead window, and is only good until the next operation on `src'.
+ */
+static inline const char *slz_get_bytes_view(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    const char *p = slz_src_peek(ctx, src, len);
+    src->pos += len;
+    return p;
+}
+
+/* INTERNAL FUNCTION DO NOT USE. */
+uint64_t slz_PRIVATE_get_varuint(slz_ctx_t *ctx, slz_src_t *src);
+
+/* A varint that's too long is SLZ_MALFORMED. */
+static inline uint64_t slz_get_varuint(slz_ctx_t *ctx, slz_src_t *src)
+{
+    /* One-byte values are the common case. */
+    if (src->pos < src->end && !(*src->pos & 0x80))
+        return (uint8_t) *src->pos++;
+    return slz_PRIVATE_get_varuint(ctx, src);
+}
+
+static inline int64_t slz_get_varint(slz_ctx_t *ctx, slz_src_t *src)
+{
+    uint64_t val = slz_get_varuint(ctx, src);
+    return (int64_t) ((val >> 1) ^ -(val & 1));
+}
+
+/* Counterparts of the slz_put_*_array functions. */
+void slz_get_uint16_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, uint16_t *out);
+void slz_get_int16_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, int16_t *out);
+void slz_get_uint32_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, uint32_t *out);
+void slz_get_int32_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, int32_t *out);
+void slz_get_uint64_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, uint64_t *out);
+void slz_get_int64_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, int64_t *out);
+void slz_get_float_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, float *out);
+void slz_get_double_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, double *out);
+void slz_get_float_array_shuffled(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, float *out);
+void slz_get_double_array_shuffled(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, double *out);
+
+void slz_get_varuint32_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, uint32_t *out);
+void slz_get_varint32_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, int32_t *out);
+
+/* Reads a blob written by slz_put_blob (or a string written by slz_put_str)
+ * into `arena', storing its length in *len if `len' isn't NULL. Strings are
+ * null-terminated; the terminator isn't counted in *len. */
+char *slz_get_blob_arena(
+    slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena, size_t *len);
+char *slz_get_str_arena(
+    slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena, size_t *len);
+
+void slz_skip_blob(slz_ctx_t *ctx, slz_src_t *src);
+
+/* Lazy blobs. slz_get_blob_lazy skips a blob (or string), noting where its
+ * bytes are, and slz_lazy_blob_read reads them on demand into `out', which
+ * must have room for blob->len bytes, leaving `src' where it was. That takes
+ * seeking back, as slz_src_seek does, unless they're still in the read-ahead
+ * window, as they always are for memory & mmap sources.
+ */
+typedef struct {
+    uint64_t offset;            /* as slz_src_tell gives */
+    uint64_t len;
+} slz_lazy_blob_t;
+
+slz_lazy_blob_t slz_get_blob_lazy(slz_ctx_t *ctx, slz_src_t *src);
+void slz_lazy_blob_read(
+    slz_ctx_t *ctx, slz_src_t *src, const slz_lazy_blob_t *blob, char *out);
 
 void slz_expect_bytes(
     slz_ctx_t *ctx, slz_src_t *src, size_t len, const char *data);
 
-/* Checks for the slz header and reads version number information. Does _not_
- * check version compatibility; use slz_compatible_version for that.
+/* Checks for the slz header and reads its format version. Does _not_ check
+ * version compatibility; use slz_compatible_version for that.
  */
 slz_version_t slz_get_magic(slz_ctx_t *ctx, slz_src_t *src);
+/* As slz_get_magic, but stores the header's flags in *flags. (slz_get_magic
+ * treats flags other than SLZ_HEADER_LITTLE_ENDIAN, which needs nothing of
+ * the caller, as a bad header, since its caller isn't expecting them.)
+ * Unknown flags are a bad header either way. */
+slz_version_t slz_get_magic_flags(
+    slz_ctx_t *ctx, slz_src_t *src, unsigned *flags);
 
 /* Checks the version number as well. */
 void slz_expect_magic(slz_ctx_t *ctx, slz_src_t *src);
 
+
+
+/* Record batches.
+ *
+ * A batch stores `nrows' records a field at a time: a header giving the
+ * number of rows & columns, then one column per field. Integer columns are
+ * bit-packed at the width of their range, after taking differences, or
+ * differences of differences, if that narrows it (as it does for sorted
+ * timestamps), so small-range IDs & regular series take a few bits per row
+ * rather than 8 bytes. Double columns are byte-shuffled (see
+ * slz_put_double_array_shuffled).
+ *
+ * Columns are put & got from strided arrays, so that one field of an array
+ * of structs can be a column: `stride' is the distance in bytes from one
+ * value to the next, sizeof(*vals) for a plain array. Integer columns can be
+ * got as any of the integer types, whatever they were put as, but values
+ * that don't fit are truncated.
+ *
+ * Readers get the batch header, then get or skip each column in turn, passing
+ * the batch's row count; skipping a column reads only its first few bytes,
+ * and seeks past the rest if the source can (see slz_skip_bytes).
+ *
+ *     slz_batch_t batch = slz_get_batch(ctx, src);
+ *     // ... allocate batch.nrows records ...
+ *     slz_get_column_int64(ctx, src, batch.nrows, &recs[0].time, sizeof *recs);
+ *     slz_skip_column(ctx, src, batch.nrows);
+ */
+typedef struct {
+    uint64_t nrows, ncols;
+} slz_batch_t;
+
+void slz_put_batch(slz_ctx_t *ctx, slz_sink_t *sink,
+                   uint64_t nrows, uint64_t ncols);
+slz_batch_t slz_get_batch(slz_ctx_t *ctx, slz_src_t *src);
+
+void slz_put_column_uint32(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                           const uint32_t *vals, size_t stride);
+void slz_put_column_int32(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                          const int32_t *vals, size_t stride);
+void slz_put_column_uint64(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                           const uint64_t *vals, size_t stride);
+void slz_put_column_int64(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                          const int64_t *vals, size_t stride);
+void slz_put_column_double(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                           const double *vals, size_t stride);
+
+void slz_get_column_uint32(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                           uint32_t *out, size_t stride);
+void slz_get_column_int32(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                          int32_t *out, size_t stride);
+void slz_get_column_uint64(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                           uint64_t *out, size_t stride);
+void slz_get_column_int64(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                          int64_t *out, size_t stride);
+void slz_get_column_double(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                           double *out, size_t stride);
+
+void slz_skip_column(slz_ctx_t *ctx, slz_src_t *src, uint64_t n);
+
+
+/* Interned strings.
+ *
+ * For streams that repeat the same strings over & over (host names, metric
+ * names, enum values), a string table remembers the ones already written, so
+ * that a repeat costs a varint id instead of the whole string. The writer
+ * attaches one to its sink, the reader another to its source, and they fill
+ * up in step: each new string is written in full, and then added to both
+ * under the next id. On the reading side, a repeat gives back a pointer to
+ * the copy the table already holds, so there's nothing to allocate.
+ *
+ * A table holds at most `max_entries' strings of at most `max_bytes' bytes
+ * in all (counting a null terminator each), and once the next string won't
+ * fit, it's written in full without being added. Both sides must use the
+ * same limits, and neither may skip an interned string, so that they make
+ * the same choices. slz_intern_reset empties a table; a writer & reader that
+ * reset theirs at the same point (a record, say, to be able to read records
+ * in any order, as from a container) also stay in step.
+ *
+ * A table is used by one sink or source at a time, and only for the
+ * functions below; the rest of the stream is as usual. Getting an interned
+ * string from a source with no table attached, or one that refers to a
+ * string the table doesn't have, is SLZ_MALFORMED.
+ */
+struct slz_intern {
+    /* Private. */
+    size_t max_entries, max_bytes;
+    size_t nentries, nbytes;
+    struct slz_intern_entry *entries;
+    size_t entries_cap;
+    uint32_t *slots;            /* writers' hash table: id + 1, or 0 */
+    size_t nslots;
+    slz_arena_t arena;          /* the strings themselves */
+    const slz_allocator_t *allocator; /* of the contexts it's used with */
+};
+
+/* 0 for either limit picks a default. Doesn't allocate anything. */
+void slz_intern_init(slz_intern_t *intern, size_t max_entries,
+                     size_t max_bytes);
+/* Forgets every string, invalidating pointers to them, but keeps the memory
+ * for reuse. */
+void slz_intern_reset(slz_intern_t *intern);
+/* Frees everything; the table can still be used afterwards. */
+void slz_intern_free(slz_intern_t *intern);
+
+/* Attach `intern' (or detach, with NULL); it must outlive the attachment. */
+void slz_src_set_intern(slz_src_t *src, slz_intern_t *intern);
+void slz_sink_set_intern(slz_sink_t *sink, slz_intern_t *intern);
+
+void slz_put_blob_interned(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data);
+void slz_put_str_interned(slz_ctx_t *ctx, slz_sink_t *sink, const char *str);
+/* Gets a string or blob put by either of the above, storing its length in
+ * *len if `len' isn't NULL. It's null-terminated, the terminator not counted
+ * in *len, and is the table's own copy, good until the table is reset or
+ * freed, unless it didn't fit there, in which case it's copied into `arena'.
+ * Either way, don't modify it. */
+const char *slz_get_str_interned(
+    slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena, size_t *len);
+
+
+
+/* Sticky errors.
+ *
+ * The slz_try_* functions are a parallel API which never jumps. When one
+ * fails, it records the error in the context (and in the src or sink involved,
+ * which also loses its place) and carries on; from then on, they do nothing,
+ * and getters return 0. So a whole record or batch can be read or written
+ * without slz_catch, and checked for errors once at the end:
+ *
+ *     for (size_t i = 0; i < n; ++i) {
+ *         recs[i].id = slz_try_get_uint32(&ctx, &src);
+ *         recs[i].stamp = slz_try_get_int64(&ctx, &src);
+ *     }
+ *     if (!slz_ok(&ctx)) {
+ *         slz_perror(&ctx, "myprog");
+ *         ...
+ *     }
+ *
+ * Since the checks for available space that fail are the same ones that
+ * succeed, these are as cheap as the ordinary functions, and inlinable.
+ * Functions from the ordinary API must not be called while an error is
+ * outstanding.
+ */
+void slz_src_clear_error(slz_src_t *src);
+void slz_sink_clear_error(slz_sink_t *sink);
+
+/* INTERNAL FUNCTIONS DO NOT USE. */
+bool slz_PRIVATE_sink_try_make_room(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len);
+bool slz_PRIVATE_src_try_fill(slz_ctx_t *ctx, slz_src_t *src, size_t len);
+void slz_PRIVATE_try_put_bytes(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data);
+void slz_PRIVATE_try_get_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out);
+uint64_t slz_PRIVATE_try_get_varuint(slz_ctx_t *ctx, slz_src_t *src);
+
+/* As slz_sink_reserve & slz_src_reserve, but return false on failure. */
+static inline bool slz_sink_try_reserve(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len)
+{
+    return (size_t) (sink->end - sink->pos) >= len
+        || slz_PRIVATE_sink_try_make_room(ctx, sink, len);
+}
+
+static inline bool slz_src_try_reserve(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    return (size_t) (src->end - src->pos) >= len
+        || slz_PRIVATE_src_try_fill(ctx, src, len);
+}
+
+/* Returns whether it succeeded. */
+bool slz_sink_try_flush(slz_ctx_t *ctx, slz_sink_t *sink);
+
+static inline void slz_try_put_bytes(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
+{
+    if ((size_t) (sink->end - sink->pos) < len) {
+        slz_PRIVATE_try_put_bytes(ctx, sink, len, data);
+        return;
+    }
+    memcpy(sink->pos, data, len);
+    sink->pos += len;
+}
+
+/* On failure, fills `out' with zeroes. */
+static inline void slz_try_get_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, char *out)
+{
+    if ((size_t) (src->end - src->pos) < len) {
+        slz_PRIVATE_try_get_bytes(ctx, src, len, out);
+        return;
+    }
+    memcpy(out, src->pos, len);
+    src->pos += len;
+}
+
+/* Returns NULL on failure. */
+static inline const char *slz_try_get_bytes_view(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    if (!slz_src_try_reserve(ctx, src, len))
+        return NULL;
+    const char *p = src->pos;
+    src->pos += len;
+    return p;
+}
+
+#define SLZ_PRIVATE_DEFINE_TRY_PUT(name, type, size)                    \
+    static inline void slz_try_put_##name(                              \
+        slz_ctx_t *ctx, slz_sink_t *sink, type val)                     \
+    {                                                                   \
+        if (slz_sink_try_reserve(ctx, sink, size))                      \
+            slz_put_##name##_unchecked(sink, val);                      \
+    }
+
+#define SLZ_PRIVATE_DEFINE_TRY_GET(name, type, size)                    \
+    static inline type slz_try_get_##name(slz_ctx_t *ctx, slz_src_t *src) \
+    {                                                                   \
+        return slz_src_try_reserve(ctx, src, size)                      \
+            ? slz_get_##name##_unchecked(src) : (type) 0;               \
+    }
+
+SLZ_PRIVATE_DEFINE_TRY_PUT(bool,       bool, 1)
+SLZ_PRIVATE_DEFINE_TRY_PUT(uint8,   uint8_t, 1)
+SLZ_PRIVATE_DEFINE_TRY_PUT(int8,     int8_t, 1)
+SLZ_PRIVATE_DEFINE_TRY_PUT(uint16, uint16_t, 2)
+SLZ_PRIVATE_DEFINE_TRY_PUT(int16,   int16_t, 2)
+SLZ_PRIVATE_DEFINE_TRY_PUT(uint32, uint32_t, 4)
+SLZ_PRIVATE_DEFINE_TRY_PUT(int32,   int32_t, 4)
+SLZ_PRIVATE_DEFINE_TRY_PUT(uint64, uint64_t, 8)
+SLZ_PRIVATE_DEFINE_TRY_PUT(int64,   int64_t, 8)
+SLZ_PRIVATE_DEFINE_TRY_PUT(float,     float, 4)
+SLZ_PRIVATE_DEFINE_TRY_PUT(double,   double, 8)
+
+SLZ_PRIVATE_DEFINE_TRY_GET(bool,       bool, 1)
+SLZ_PRIVATE_DEFINE_TRY_GET(uint8,   uint8_t, 1)
+SLZ_PRIVATE_DEFINE_TRY_GET(int8,     int8_t, 1)
+SLZ_PRIVATE_DEFINE_TRY_GET(uint16, uint16_t, 2)
+SLZ_PRIVATE_DEFINE_TRY_GET(int16,   int16_t, 2)
+SLZ_PRIVATE_DEFINE_TRY_GET(uint32, uint32_t, 4)
+SLZ_PRIVATE_DEFINE_TRY_GET(int32,   int32_t, 4)
+SLZ_PRIVATE_DEFINE_TRY_GET(uint64, uint64_t, 8)
+SLZ_PRIVATE_DEFINE_TRY_GET(int64,   int64_t, 8)
+SLZ_PRIVATE_DEFINE_TRY_GET(float,     float, 4)
+SLZ_PRIVATE_DEFINE_TRY_GET(double,   double, 8)
+
+static inline void slz_try_put_varuint(
+    slz_ctx_t *ctx, slz_sink_t *sink, uint64_t val)
+{
+    if (!slz_sink_try_reserve(ctx, sink, SLZ_VARINT_MAX))
+        return;
+    unsigned char *p = (unsigned char*) sink->pos;
+    while (val >= 0x80) {
+        *p++ = (unsigned char) (val | 0x80);
+        val >>= 7;
+    }
+    *p++ = (unsigned char) val;
+    sink->pos = (char*) p;
+}
+
+static inline void slz_try_put_varint(
+    slz_ctx_t *ctx, slz_sink_t *sink, int64_t val)
+{
+    slz_try_put_varuint(
+        ctx, sink, ((uint64_t) val << 1) ^ -((uint64_t) val >> 63));
+}
+
+static inline uint64_t slz_try_get_varuint(slz_ctx_t *ctx, slz_src_t *src)
+{
+    if (src->pos < src->end && !(*src->pos & 0x80))
+        return (uint8_t) *src->pos++;
+    return slz_PRIVATE_try_get_varuint(ctx, src);
+}
+
+static inline int64_t slz_try_get_varint(slz_ctx_t *ctx, slz_src_t *src)
+{
+    uint64_t val = slz_try_get_varuint(ctx, src);
+    return (int64_t) ((val >> 1) ^ -(val & 1));
+}
+
+
+
+/* Seekable containers.
+ *
+ * A container groups records into length-prefixed chunks, and ends with an
+ * index of the chunks, so that a reader with the whole container at hand can
+ * go straight to any record. (See slz_container.c for the layout.)
+ *
+ * To write one, bracket each record with slz_container_begin_record, which
+ * returns the sink to serialize the record to, and slz_container_end_record.
+ * Records are buffered in memory until there are at least `chunk_size' bytes
+ * of them (or slz_container_end_chunk is called), then written to `out' as a
+ * chunk. slz_container_writer_finish writes the last chunk and the index, but
+ * doesn't flush `out'. Records and chunks must be smaller than 4GB.
+ */
+typedef struct {
+    slz_sink_t *out;
+    slz_sink_t chunk;
+    size_t chunk_size;
+    size_t record_start;
+    uint64_t offset, nrecords, chunk_first;
+    uint64_t *index;
+    size_t nchunks, index_cap;
+} slz_container_writer_t;
+
+/* `chunk_size' 0 picks a default. */
+void slz_container_writer_init(slz_ctx_t *ctx, slz_container_writer_t *w,
+                               slz_sink_t *out, size_t chunk_size);
+slz_sink_t *slz_container_begin_record(
+    slz_ctx_t *ctx, slz_container_writer_t *w);
+void slz_container_end_record(slz_ctx_t *ctx, slz_container_writer_t *w);
+void slz_container_end_chunk(slz_ctx_t *ctx, slz_container_writer_t *w);
+void slz_container_writer_finish(slz_ctx_t *ctx, slz_container_writer_t *w);
+void slz_container_writer_destroy(slz_ctx_t *ctx, slz_container_writer_t *w);
+
+/* Reading requires the whole container to be in `src's window, ending at
+ * src->end, as it is for sources from slz_src_from_memory or
+ * slz_src_from_path. `src' is not consumed, and must outlive the reader. A
+ * missing index is SLZ_BAD_HEADER; an inconsistent one, SLZ_MALFORMED.
+ */
+typedef struct {
+    slz_src_t *src;
+    const char *start, *index;
+    uint64_t body_len, nchunks, nrecords;
+    /* Where the record after the last one got is, to make sequential reads
+     * cheap. */
+    uint64_t next_record;
+    const char *next_pos, *chunk_end;
+} slz_container_reader_t;
+
+void slz_container_reader_open(
+    slz_ctx_t *ctx, slz_container_reader_t *r, slz_src_t *src);
+uint64_t slz_container_num_records(slz_container_reader_t *r);
+uint64_t slz_container_num_chunks(slz_container_reader_t *r);
+
+/* Initializes `record' as a memory source over record number `n' (counting
+ * from 0). Returns false if there is no such record. */
+bool slz_container_get_record(
+    slz_ctx_t *ctx, slz_container_reader_t *r, uint64_t n, slz_src_t *record);
+
+/* Initializes `chunk' as a memory source over the records of chunk number
+ * `i', storing the number of its first record in *first and its number of
+ * records in *count, if they aren't NULL. Returns false if there is no such
+ * chunk. Use slz_container_chunk_next to go through its records. */
+bool slz_container_get_chunk(
+    slz_ctx_t *ctx, slz_container_reader_t *r, uint64_t i,
+    slz_src_t *chunk, uint64_t *first, uint32_t *count);
+
+/* Initializes `record' as a memory source over the next record of `chunk', or
+ * returns false if there are no more. */
+bool slz_container_chunk_next(
+    slz_ctx_t *ctx, slz_src_t *chunk, slz_src_t *record);
+
+/* Parallel encoding & decoding (needs -pthread).
+ *
+ * slz_container_put_parallel appends `nrecords' records to the container,
+ * encoding them on `nthreads' threads (0 for one per CPU) by calling
+ * encode(ctx, sink, i, userdata) for i from 0 to nrecords - 1. Each call gets
+ * the calling thread's own ctx, running under slz_catch and sharing `ctx's
+ * allocator, and the sink to serialize record i to. Records are handed out
+ * `batch' at a time (0 picks a batch size), and each batch is split into
+ * chunks of roughly w->chunk_size bytes, so the container is as good for
+ * random access as a sequentially written one. Any record in progress must
+ * have been ended, and the current chunk is ended first.
+ *
+ * slz_container_get_parallel reads the chunks of a container from `src', up
+ * to and including the end-of-chunks marker (leaving the index unread), and
+ * decodes them on `nthreads' threads by calling decode(ctx, record, i,
+ * userdata) for each record, where i counts records from 0. Calls for
+ * different chunks run concurrently and in no particular order. It returns
+ * the number of records. Unlike the rest of the reader, it doesn't need the
+ * whole container in memory: chunks are read into buffers of their own, and
+ * at most two per thread are held at once.
+ *
+ * Errors in the callbacks, including sticky ones left by the slz_try_*
+ * functions, are raised from the calling thread, once the workers have
+ * stopped; a record that its callback reads past the end of is
+ * SLZ_MALFORMED.
+ */
+void slz_container_put_parallel(
+    slz_ctx_t *ctx, slz_container_writer_t *w, size_t nrecords,
+    void (*encode)(slz_ctx_t *ctx, slz_sink_t *sink, size_t i, void *data),
+    void *userdata,
+    unsigned nthreads, size_t batch);
+uint64_t slz_container_get_parallel(
+    slz_ctx_t *ctx, slz_src_t *src,
+    void (*decode)(slz_ctx_t *ctx, slz_src_t *src, uint64_t i, void *data),
+    void *userdata, unsigned nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,519 @@
+#ifndef _SLZ_HPP_
+#define _SLZ_HPP_
+
+/* C++ interface to libslz. Requires C++17.
+ *
+ * Errors are reported by throwing slz::error rather than by longjmp, so
+ * there's no slz_catch; libslz is built with -fexceptions so that exceptions
+ * can unwind through it.
+ *
+ * Values are serialized with slz::put and deserialized with slz::get. Out of
+ * the box, these handle integers, bools, enums, std::string (as a blob; see
+ * slz_put_blob), std::vector and std::array. To handle your own structs,
+ * describe their fields by specializing slz::fields:
+ *
+ *     struct point { int32_t x, y; };
+ *     template <> struct slz::fields<point> {
+ *         static constexpr auto members =
+ *             std::make_tuple(&point::x, &point::y);
+ *     };
+ *
+ * The fields are then put & got in order. If every field has a fixed encoded
+ * size, so does the struct (see slz::encoded_size), and putting or getting it
+ * makes a single check for space and then stores or loads each field
+ * directly.
+ */
+
+#include "slz.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace slz {
+
+/* Thrown for any error libslz reports. By the time it's caught, the context
+ * has been reset, so it can be used again; the source or sink involved, on
+ * the other hand, is probably best abandoned. */
+class error : public std::runtime_error {
+  public:
+    error(slz_state_t state, const std::string &what)
+        : std::runtime_error(what), state_(state) {}
+    slz_state_t state() const { return state_; }
+  private:
+    slz_state_t state_;
+};
+
+namespace detail {
+inline std::string io_message(
+    size_t (*strerror)(void *obj, char *buf, size_t buflen), void *obj)
+{
+    std::string msg(100, '\0');
+    for (;;) {
+        size_t needed = strerror(obj, &msg[0], msg.size());
+        if (!needed)
+            break;
+        if (needed == SIZE_MAX && msg.size() >= 65536)
+            return "unknown I/O error";
+        msg.resize(needed == SIZE_MAX ? msg.size() * 2 : needed);
+    }
+    msg.resize(msg.find('\0'));
+    return msg;
+}
+
+inline std::string message(slz_ctx_t *ctx)
+{
+    switch ((enum slz_state) ctx->state) {
+      case SLZ_IO_ERROR:
+        if (ctx->origin_type == SLZ_SRC)
+            return io_message(ctx->origin.src->funcs->strerror,
+                              ctx->origin.src->obj);
+        return io_message(ctx->origin.sink->funcs->strerror,
+                          ctx->origin.sink->obj);
+      case SLZ_BAD_HEADER:
+        return "bad magic number or malformed header";
+      case SLZ_UNFULFILLED_EXPECTATIONS:
+        return "unexpected value";
+      case SLZ_OOM:
+        return "out of memory";
+      case SLZ_MALFORMED:
+        return "malformed data";
+      case SLZ_BAD_CHECKSUM:
+        return "checksum mismatch; data is corrupt";
+      case SLZ_INCOMPLETE:
+        return "incomplete data";
+      case SLZ_CANT_SEEK:
+        return "can't seek back that far in this source";
+      case SLZ_OK:
+        break;
+    }
+    return "unknown error";
+}
+
+/* The context's toplevel error handler. */
+inline void throw_error(slz_ctx_t *ctx, void *)
+{
+    slz_state_t state = ctx->state;
+    std::string what = "libslz: " + message(ctx);
+    slz_clear_error(ctx);
+    throw error(state, what);
+}
+} // namespace detail
+
+
+/* Contexts, sources & sinks.
+ *
+ * A context must outlive the sources & sinks that use it. Sources & sinks may
+ * be moved but not copied; they're destroyed along with their C
+ * counterparts. Sinks are NOT flushed on destruction, since that could
+ * fail; call flush(). */
+class context {
+  public:
+    context() { slz_init(&ctx_, detail::throw_error, nullptr); }
+    context(const context &) = delete;
+    context &operator=(const context &) = delete;
+
+    slz_ctx_t *get() { return &ctx_; }
+
+  private:
+    slz_ctx_t ctx_;
+};
+
+class sink {
+  public:
+    /* Writes to `file', which we don't close. */
+    sink(context &ctx, FILE *file) : ctx_(ctx.get()) {
+        slz_sink_from_file(ctx_, &sink_, file);
+    }
+    /* Writes to memory; see release(). */
+    explicit sink(context &ctx) : ctx_(ctx.get()) {
+        slz_sink_to_memory(ctx_, &sink_);
+    }
+    sink(sink &&other) : ctx_(other.ctx_), sink_(other.sink_) {
+        other.ctx_ = nullptr;
+    }
+    sink(const sink &) = delete;
+    sink &operator=(const sink &) = delete;
+    ~sink() { if (ctx_) slz_sink_destroy(ctx_, &sink_); }
+
+    void flush() { slz_sink_flush(ctx_, &sink_); }
+    void put_magic() { slz_put_magic(ctx_, &sink_); }
+
+    /* For memory sinks: everything written so far. */
+    std::string release() {
+        size_t len;
+        char *buf = slz_sink_memory_release(ctx_, &sink_, &len);
+        std::string data(buf ? buf : "", buf ? len : 0);
+        free(buf);
+        return data;
+    }
+
+    slz_ctx_t *ctx() { return ctx_; }
+    slz_sink_t *get() { return &sink_; }
+
+  private:
+    slz_ctx_t *ctx_;
+    slz_sink_t sink_;
+};
+
+class source {
+  public:
+    /* Reads from `file', which we don't close. */
+    source(context &ctx, FILE *file) : ctx_(ctx.get()) {
+        slz_src_from_file(ctx_, &src_, file);
+    }
+    /* Reads from memory, which must outlive the source. */
+    source(context &ctx, const char *data, size_t len) : ctx_(ctx.get()) {
+        slz_src_from_memory(ctx_, &src_, data, len);
+    }
+    /* Reads from a memory mapping of `path'; see slz_src_from_path. */
+    static source map_file(context &ctx, const char *path,
+                           unsigned mmap_flags = 0) {
+        return source(ctx, path, mmap_flags, map_tag());
+    }
+    source(source &&other) : ctx_(other.ctx_), src_(other.src_) {
+        other.ctx_ = nullptr;
+    }
+    source(const source &) = delete;
+    source &operator=(const source &) = delete;
+    ~source() { if (ctx_) slz_src_destroy(ctx_, &src_); }
+
+    void expect_magic() { slz_expect_magic(ctx_, &src_); }
+
+    slz_ctx_t *ctx() { return ctx_; }
+    slz_src_t *get() { return &src_; }
+
+  private:
+    struct map_tag {};
+    source(context &ctx, const char *path, unsigned mmap_flags, map_tag)
+        : ctx_(ctx.get()) {
+        /* If allocating fails, src_ never gets initialized. */
+        src_.funcs = nullptr;
+        try {
+            slz_src_from_path(ctx_, &src_, path, mmap_flags);
+        }
+        catch (...) {
+            if (src_.funcs)
+                slz_src_destroy(ctx_, &src_);
+            throw;
+        }
+    }
+
+    slz_ctx_t *ctx_;
+    slz_src_t src_;
+};
+
+
+/* Describing structs. Specialize this with a `members' tuple of pointers to
+ * members, as above. */
+template <typename T> struct fields;
+
+
+/* Codecs.
+ *
+ * codec<T> says how to put & get a T. Every codec has
+ *
+ *     static constexpr bool fixed;       // has a fixed encoded size?
+ *     static void put(slz_ctx_t*, slz_sink_t*, const T&);
+ *     static void get(slz_ctx_t*, slz_src_t*, T&);
+ *
+ * and fixed-size codecs also have
+ *
+ *     static constexpr size_t size;
+ *     static void put_unchecked(slz_sink_t*, const T&);
+ *     static void get_unchecked(slz_src_t*, T&);
+ *
+ * which may only be used on space secured with slz_sink_reserve or
+ * slz_src_reserve.
+ */
+template <typename T, typename = void> struct codec;
+
+namespace detail {
+template <typename T, typename = void> struct has_fields : std::false_type {};
+template <typename T>
+struct has_fields<T, std::void_t<decltype(fields<T>::members)>>
+    : std::true_type {};
+
+/* Fixed-size codecs get their put & get from their unchecked versions. */
+template <typename T, typename Codec> struct fixed_codec {
+    static constexpr bool fixed = true;
+    static void put(slz_ctx_t *ctx, slz_sink_t *sink, const T &val) {
+        slz_sink_reserve(ctx, sink, Codec::size);
+        Codec::put_unchecked(sink, val);
+    }
+    static void get(slz_ctx_t *ctx, slz_src_t *src, T &val) {
+        slz_src_reserve(ctx, src, Codec::size);
+        Codec::get_unchecked(src, val);
+    }
+};
+} // namespace detail
+
+template <> struct codec<bool> : detail::fixed_codec<bool, codec<bool>> {
+    static constexpr size_t size = 1;
+    static void put_unchecked(slz_sink_t *sink, bool val) {
+        slz_put_bool_unchecked(sink, val);
+    }
+    static void get_unchecked(slz_src_t *src, bool &val) {
+        val = slz_get_bool_unchecked(src);
+    }
+};
+
+/* Integers of any type, encoded according to their size & signedness. */
+template <typename T>
+struct codec<T, std::enable_if_t<std::is_integral_v<T> &&
+                                 !std::is_same_v<T, bool>>>
+    : detail::fixed_codec<T, codec<T>> {
+    static_assert(sizeof(T) == 1 || sizeof(T) == 2 ||
+                  sizeof(T) == 4 || sizeof(T) == 8);
+    static constexpr size_t size = sizeof(T);
+    static void put_unchecked(slz_sink_t *sink, T val) {
+        if constexpr (sizeof(T) == 1) slz_put_uint8_unchecked(sink, val);
+        else if constexpr (sizeof(T) == 2) slz_put_uint16_unchecked(sink, val);
+        else if constexpr (sizeof(T) == 4) slz_put_uint32_unchecked(sink, val);
+        else slz_put_uint64_unchecked(sink, val);
+    }
+    static void get_unchecked(slz_src_t *src, T &val) {
+        if constexpr (sizeof(T) == 1)
+            val = (T) slz_get_uint8_unchecked(src);
+        else if constexpr (sizeof(T) == 2)
+            val = (T) slz_get_uint16_unchecked(src);
+        else if constexpr (sizeof(T) == 4)
+            val = (T) slz_get_uint32_unchecked(src);
+        else val = (T) slz_get_uint64_unchecked(src);
+    }
+};
+
+/* Enums, as their underlying type. */
+template <typename T>
+struct codec<T, std::enable_if_t<std::is_enum_v<T>>>
+    : detail::fixed_codec<T, codec<T>> {
+    using under = codec<std::underlying_type_t<T>>;
+    static constexpr size_t size = under::size;
+    static void put_unchecked(slz_sink_t *sink, T val) {
+        under::put_unchecked(sink, (std::underlying_type_t<T>) val);
+    }
+    static void get_unchecked(slz_src_t *src, T &val) {
+        std::underlying_type_t<T> v;
+        under::get_unchecked(src, v);
+        val = (T) v;
+    }
+};
+
+namespace detail {
+/* How much of a string or vector to make room for at a time when getting it,
+ * so that a bogus length runs out of data before it runs out of memory. */
+constexpr size_t get_piece = 64 * 1024;
+} // namespace detail
+
+/* Strings, as blobs. */
+template <> struct codec<std::string> {
+    static constexpr bool fixed = false;
+    static void put(slz_ctx_t *ctx, slz_sink_t *sink, const std::string &s) {
+        slz_put_blob(ctx, sink, s.size(), s.data());
+    }
+    static void get(slz_ctx_t *ctx, slz_src_t *src, std::string &s) {
+        uint64_t n = slz_get_varuint(ctx, src);
+        s.clear();
+        while (n) {
+            size_t len = n < detail::get_piece ? n : detail::get_piece;
+            size_t have = s.size();
+            s.resize(have + len);
+            slz_get_bytes(ctx, src, len, &s[have]);
+            n -= len;
+        }
+    }
+};
+
+/* Fixed-length arrays, as their elements. */
+template <typename T, size_t N> struct codec<std::array<T, N>> {
+    static constexpr bool fixed = codec<T>::fixed;
+    static void put(slz_ctx_t *ctx, slz_sink_t *sink,
+                    const std::array<T, N> &a) {
+        if constexpr (fixed) {
+            slz_sink_reserve(ctx, sink, size_of());
+            put_unchecked(sink, a);
+        }
+        else for (const T &v : a) codec<T>::put(ctx, sink, v);
+    }
+    static void get(slz_ctx_t *ctx, slz_src_t *src, std::array<T, N> &a) {
+        if constexpr (fixed) {
+            slz_src_reserve(ctx, src, size_of());
+            get_unchecked(src, a);
+        }
+        else for (T &v : a) codec<T>::get(ctx, src, v);
+    }
+
+    static constexpr size_t size_of() {
+        if constexpr (fixed) return N * codec<T>::size;
+        else return 0;
+    }
+    static constexpr size_t size = size_of();
+    static void put_unchecked(slz_sink_t *sink, const std::array<T, N> &a) {
+        for (const T &v : a) codec<T>::put_unchecked(sink, v);
+    }
+    static void get_unchecked(slz_src_t *src, std::array<T, N> &a) {
+        for (T &v : a) codec<T>::get_unchecked(src, v);
+    }
+};
+
+/* Vectors: a varuint count, then the elements. Vectors of 16-, 32- and 64-bit
+ * integers use the bulk array functions, and are encoded the same way. */
+template <typename T, typename A> struct codec<std::vector<T, A>> {
+    static constexpr bool fixed = false;
+    static constexpr bool bulk = std::is_integral_v<T> &&
+        (sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+    using bulk_type = std::conditional_t<
+        sizeof(T) == 2, uint16_t,
+        std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>;
+
+    static void put(slz_ctx_t *ctx, slz_sink_t *sink,
+                    const std::vector<T, A> &v) {
+        slz_put_varuint(ctx, sink, v.size());
+        if constexpr (bulk) {
+            const bulk_type *p = reinterpret_cast<const bulk_type*>(v.data());
+            if constexpr (sizeof(T) == 2)
+                slz_put_uint16_array(ctx, sink, v.size(), p);
+            else if constexpr (sizeof(T) == 4)
+                slz_put_uint32_array(ctx, sink, v.size(), p);
+            else slz_put_uint64_array(ctx, sink, v.size(), p);
+        }
+        else for (const T &x : v) codec<T>::put(ctx, sink, x);
+    }
+
+    static void get(slz_ctx_t *ctx, slz_src_t *src, std::vector<T, A> &v) {
+        uint64_t n = slz_get_varuint(ctx, src);
+        v.clear();
+        /* Don't trust a count we haven't read the elements for yet. */
+        if constexpr (bulk) {
+            const size_t piece = detail::get_piece / sizeof(T);
+            while (n) {
+                size_t len = n < piece ? n : piece;
+                size_t have = v.size();
+                v.resize(have + len);
+                bulk_type *p = reinterpret_cast<bulk_type*>(v.data() + have);
+                if constexpr (sizeof(T) == 2)
+                    slz_get_uint16_array(ctx, src, len, p);
+                else if constexpr (sizeof(T) == 4)
+                    slz_get_uint32_array(ctx, src, len, p);
+                else slz_get_uint64_array(ctx, src, len, p);
+                n -= len;
+            }
+        }
+        else {
+            v.reserve(n < 4096 ? n : 4096);
+            for (uint64_t i = 0; i < n; ++i) {
+                T x;
+                codec<T>::get(ctx, src, x);
+                v.push_back(std::move(x));
+            }
+        }
+    }
+};
+
+/* Structs described with slz::fields. */
+template <typename T>
+struct codec<T, std::enable_if_t<detail::has_fields<T>::value>> {
+    static constexpr auto members = fields<T>::members;
+
+    template <typename M> struct member_codec;
+    template <typename F> struct member_codec<F T::*> {
+        using type = codec<F>;
+    };
+    template <size_t I>
+    using codec_at = typename member_codec<
+        std::remove_cv_t<std::tuple_element_t<
+                             I, std::remove_cv_t<decltype(members)>>>>::type;
+
+    template <size_t... I>
+    static constexpr bool all_fixed(std::index_sequence<I...>) {
+        return (codec_at<I>::fixed && ...);
+    }
+    template <size_t... I>
+    static constexpr size_t total_size(std::index_sequence<I...>) {
+        return (codec_at<I>::size + ... + 0);
+    }
+    using indices = std::make_index_sequence<
+        std::tuple_size_v<std::remove_cv_t<decltype(members)>>>;
+
+    static constexpr bool fixed = all_fixed(indices{});
+
+    static constexpr size_t size_of() {
+        if constexpr (fixed) return total_size(indices{});
+        else return 0;
+    }
+    static constexpr size_t size = size_of();
+
+    template <size_t... I>
+    static void put_unchecked_(slz_sink_t *sink, const T &val,
+                               std::index_sequence<I...>) {
+        (codec_at<I>::put_unchecked(sink, val.*std::get<I>(members)), ...);
+    }
+    template <size_t... I>
+    static void get_unchecked_(slz_src_t *src, T &val,
+                               std::index_sequence<I...>) {
+        (codec_at<I>::get_unchecked(src, val.*std::get<I>(members)), ...);
+    }
+    static void put_unchecked(slz_sink_t *sink, const T &val) {
+        put_unchecked_(sink, val, indices{});
+    }
+    static void get_unchecked(slz_src_t *src, T &val) {
+        get_unchecked_(src, val, indices{});
+    }
+
+    template <size_t... I>
+    static void put_(slz_ctx_t *ctx, slz_sink_t *sink, const T &val,
+                     std::index_sequence<I...>) {
+        (codec_at<I>::put(ctx, sink, val.*std::get<I>(members)), ...);
+    }
+    template <size_t... I>
+    static void get_(slz_ctx_t *ctx, slz_src_t *src, T &val,
+                     std::index_sequence<I...>) {
+        (codec_at<I>::get(ctx, src, val.*std::get<I>(members)), ...);
+    }
+
+    static void put(slz_ctx_t *ctx, slz_sink_t *sink, const T &val) {
+        if constexpr (fixed) {
+            slz_sink_reserve(ctx, sink, size);
+            put_unchecked(sink, val);
+        }
+        else put_(ctx, sink, val, indices{});
+    }
+    static void get(slz_ctx_t *ctx, slz_src_t *src, T &val) {
+        if constexpr (fixed) {
+            slz_src_reserve(ctx, src, size);
+            get_unchecked(src, val);
+        }
+        else get_(ctx, src, val, indices{});
+    }
+};
+
+
+/* The encoded size of a T, if it's fixed. */
+template <typename T>
+constexpr size_t encoded_size = codec<T>::size;
+
+template <typename T> void put(sink &s, const T &val) {
+    codec<T>::put(s.ctx(), s.get(), val);
+}
+
+template <typename T> void get(source &s, T &val) {
+    codec<T>::get(s.ctx(), s.get(), val);
+}
+
+template <typename T> T get(source &s) {
+    T val;
+    get(s, val);
+    return val;
+}
+
+} // namespace slz
+
+#endif
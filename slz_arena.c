@@ -0,0 +1,404 @@
+/* Arenas for deserialized strings & blobs, and tables of interned ones. */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+/* Chunks double in size up to this, so that many small strings end up in a
+ * handful of big allocations. */
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+struct slz_arena_chunk {
+    slz_arena_chunk_t *next;
+    size_t size;
+};
+
+void slz_arena_init(slz_arena_t *arena, size_t chunk_size)
+{
+    arena->chunks = NULL;
+    arena->pos = arena->end = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE;
+    arena->allocator = NULL;
+}
+
+static char *chunk_data(slz_arena_chunk_t *chunk) {
+    return (char*) (chunk + 1);
+}
+
+static void *alloc_slow(slz_ctx_t *ctx, slz_arena_t *arena, size_t size)
+{
+    /* The arena is freed without a context, so note whose memory it is. */
+    assert (!arena->chunks || arena->allocator == ctx->allocator);
+    arena->allocator = ctx->allocator;
+
+    /* Anything that would use up a good part of a chunk gets its own, so as
+     * not to waste what's left of the current one. */
+    if (size > arena->chunk_size / 4 && arena->chunks) {
+        slz_arena_chunk_t *chunk =
+            slz_malloc(ctx, sizeof(slz_arena_chunk_t) + size);
+        chunk->size = size;
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+        return chunk_data(chunk);
+    }
+
+    size_t chunk_size = arena->chunk_size;
+    while (chunk_size < size)
+        chunk_size *= 2;
+    slz_arena_chunk_t *chunk =
+        slz_malloc(ctx, sizeof(slz_arena_chunk_t) + chunk_size);
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->pos = chunk_data(chunk) + size;
+    arena->end = chunk_data(chunk) + chunk_size;
+    if (arena->chunk_size < MAX_CHUNK_SIZE)
+        arena->chunk_size *= 2;
+    return chunk_data(chunk);
+}
+
+/* Unaligned allocation, for bytes. */
+static char *alloc_bytes(slz_ctx_t *ctx, slz_arena_t *arena, size_t size)
+{
+    if ((size_t) (arena->end - arena->pos) >= size) {
+        char *p = arena->pos;
+        arena->pos += size;
+        return p;
+    }
+    return alloc_slow(ctx, arena, size);
+}
+
+void *slz_arena_alloc(slz_ctx_t *ctx, slz_arena_t *arena, size_t size)
+{
+    uintptr_t pos = (uintptr_t) arena->pos;
+    size_t pad = (ARENA_ALIGN - pos % ARENA_ALIGN) % ARENA_ALIGN;
+    if ((size_t) (arena->end - arena->pos) >= pad &&
+        (size_t) (arena->end - arena->pos) - pad >= size) {
+        char *p = arena->pos + pad;
+        arena->pos = p + size;
+        return p;
+    }
+    /* Fresh chunks are aligned by the allocator. */
+    return alloc_slow(ctx, arena, size);
+}
+
+void slz_arena_reset(slz_arena_t *arena)
+{
+    /* Keep the current chunk, which is the biggest ordinary one, and give the
+     * rest back. */
+    slz_arena_chunk_t *chunk = arena->chunks;
+    if (!chunk)
+        return;
+    slz_arena_chunk_t *next = chunk->next;
+    while (next) {
+        slz_arena_chunk_t *tmp = next->next;
+        slz_allocator_free(arena->allocator, next);
+        next = tmp;
+    }
+    chunk->next = NULL;
+    arena->pos = chunk_data(chunk);
+    arena->end = chunk_data(chunk) + chunk->size;
+}
+
+void slz_arena_free(slz_arena_t *arena)
+{
+    while (arena->chunks) {
+        slz_arena_chunk_t *next = arena->chunks->next;
+        slz_allocator_free(arena->allocator, arena->chunks);
+        arena->chunks = next;
+    }
+    arena->pos = arena->end = NULL;
+}
+
+
+/* Strings & blobs. */
+void slz_put_blob(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
+{
+    slz_put_varuint(ctx, sink, len);
+    slz_put_bytes(ctx, sink, len, data);
+}
+
+void slz_put_str(slz_ctx_t *ctx, slz_sink_t *sink, const char *str)
+{
+    slz_put_blob(ctx, sink, strlen(str), str);
+}
+
+/* Gets the `len' bytes of a blob into `arena', with `extra' to spare. */
+static char *get_blob_bytes(slz_ctx_t *ctx, slz_src_t *src,
+                            slz_arena_t *arena, uint64_t len, size_t extra)
+{
+    if (len > SIZE_MAX - extra) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+    char *p = alloc_bytes(ctx, arena, (size_t) len + extra);
+    slz_get_bytes(ctx, src, (size_t) len, p);
+    return p;
+}
+
+static char *get_blob(slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena,
+                      size_t *lenp, size_t extra)
+{
+    uint64_t len = slz_get_varuint(ctx, src);
+    char *p = get_blob_bytes(ctx, src, arena, len, extra);
+    if (lenp)
+        *lenp = (size_t) len;
+    return p;
+}
+
+char *slz_get_blob_arena(
+    slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena, size_t *len)
+{
+    return get_blob(ctx, src, arena, len, 0);
+}
+
+char *slz_get_str_arena(
+    slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena, size_t *len)
+{
+    size_t n;
+    char *p = get_blob(ctx, src, arena, &n, 1);
+    p[n] = '\0';
+    if (len)
+        *len = n;
+    return p;
+}
+
+void slz_skip_blob(slz_ctx_t *ctx, slz_src_t *src)
+{
+    slz_skip_bytes(ctx, src, slz_get_varuint(ctx, src));
+}
+
+slz_lazy_blob_t slz_get_blob_lazy(slz_ctx_t *ctx, slz_src_t *src)
+{
+    slz_lazy_blob_t blob;
+    blob.len = slz_get_varuint(ctx, src);
+    blob.offset = slz_src_tell(src);
+    slz_skip_bytes(ctx, src, blob.len);
+    return blob;
+}
+
+void slz_lazy_blob_read(
+    slz_ctx_t *ctx, slz_src_t *src, const slz_lazy_blob_t *blob, char *out)
+{
+    uint64_t pos = slz_src_tell(src);
+    slz_src_seek(ctx, src, blob->offset);
+    slz_get_bytes(ctx, src, (size_t) blob->len, out);
+    slz_src_seek(ctx, src, pos);
+}
+
+
+/* Interned strings.
+ *
+ * Each is a varuint tag. An even one, 2 * len, is a new string, whose len
+ * bytes follow; if it fits, writer & reader both add it to their tables
+ * under the next id. An odd one, 2 * id + 1, refers to one already added.
+ * Since both sides decide whether a string fits from the same sequence of
+ * strings, the ids never need writing down.
+ *
+ * Both keep the strings, null-terminated, in the table's arena, and an array
+ * of entries indexed by id. The writer also needs to look strings up, for
+ * which it keeps an open-addressed hash table of ids, at most half full.
+ */
+#define DEFAULT_MAX_ENTRIES (64 * 1024)
+#define DEFAULT_MAX_BYTES (4 * 1024 * 1024)
+#define MIN_SLOTS 64
+
+struct slz_intern_entry {
+    const char *data;
+    size_t len;
+    uint64_t hash;              /* writers only */
+};
+
+typedef struct slz_intern_entry entry_t;
+
+void slz_intern_init(slz_intern_t *intern, size_t max_entries,
+                     size_t max_bytes)
+{
+    max_entries = max_entries ? max_entries : DEFAULT_MAX_ENTRIES;
+    /* Slots hold id + 1 in a uint32_t. */
+    intern->max_entries =
+        max_entries < UINT32_MAX - 1 ? max_entries : UINT32_MAX - 1;
+    intern->max_bytes = max_bytes ? max_bytes : DEFAULT_MAX_BYTES;
+    intern->nentries = intern->nbytes = 0;
+    intern->entries = NULL;
+    intern->entries_cap = 0;
+    intern->slots = NULL;
+    intern->nslots = 0;
+    slz_arena_init(&intern->arena, 0);
+    intern->allocator = NULL;
+}
+
+void slz_intern_reset(slz_intern_t *intern)
+{
+    intern->nentries = intern->nbytes = 0;
+    if (intern->slots)
+        memset(intern->slots, 0, intern->nslots * sizeof *intern->slots);
+    slz_arena_reset(&intern->arena);
+}
+
+void slz_intern_free(slz_intern_t *intern)
+{
+    slz_allocator_free(intern->allocator, intern->entries);
+    slz_allocator_free(intern->allocator, intern->slots);
+    slz_arena_free(&intern->arena);
+    slz_intern_init(intern, intern->max_entries, intern->max_bytes);
+}
+
+void slz_src_set_intern(slz_src_t *src, slz_intern_t *intern) {
+    src->intern = intern;
+    slz_src_push_intern_changed(src);
+}
+
+void slz_sink_set_intern(slz_sink_t *sink, slz_intern_t *intern) {
+    sink->intern = intern;
+}
+
+static bool fits(const slz_intern_t *intern, uint64_t len)
+{
+    return intern->nentries < intern->max_entries
+        && len < intern->max_bytes - intern->nbytes;
+}
+
+/* A word at a time, the last one overlapping the one before if need be. */
+static uint64_t hash_bytes(const char *p, size_t len)
+{
+    uint64_t h = len * UINT64_C(0x9e3779b97f4a7c15), w = 0;
+    if (len < 8) {
+        for (size_t i = 0; i < len; ++i)
+            w = w << 8 | (unsigned char) p[i];
+    }
+    else {
+        const char *last = p + len - 8;
+        for (; p < last; p += 8) {
+            memcpy(&w, p, 8);
+            h = (h ^ w) * UINT64_C(0xff51afd7ed558ccd);
+            h ^= h >> 32;
+        }
+        memcpy(&w, last, 8);
+    }
+    h = (h ^ w) * UINT64_C(0xff51afd7ed558ccd);
+    return h ^ (h >> 29);
+}
+
+/* Makes room for one more entry, and for the writer, one more slot. */
+static void reserve_entry(slz_ctx_t *ctx, slz_intern_t *intern, bool writer)
+{
+    assert (!intern->allocator || intern->allocator == ctx->allocator);
+    intern->allocator = ctx->allocator;
+
+    if (intern->nentries == intern->entries_cap) {
+        size_t cap = intern->entries_cap ? 2 * intern->entries_cap : MIN_SLOTS;
+        cap = cap < intern->max_entries ? cap : intern->max_entries;
+        entry_t *entries = slz_malloc(ctx, cap * sizeof *entries);
+        if (intern->nentries)
+            memcpy(entries, intern->entries,
+                   intern->nentries * sizeof *entries);
+        slz_free(ctx, intern->entries);
+        intern->entries = entries;
+        intern->entries_cap = cap;
+    }
+
+    if (writer && 2 * (intern->nentries + 1) > intern->nslots) {
+        size_t nslots = intern->nslots ? 2 * intern->nslots : MIN_SLOTS;
+        uint32_t *slots = slz_malloc(ctx, nslots * sizeof *slots);
+        memset(slots, 0, nslots * sizeof *slots);
+        for (size_t id = 0; id < intern->nentries; ++id) {
+            size_t i = intern->entries[id].hash & (nslots - 1);
+            while (slots[i])
+                i = (i + 1) & (nslots - 1);
+            slots[i] = (uint32_t) id + 1;
+        }
+        slz_free(ctx, intern->slots);
+        intern->slots = slots;
+        intern->nslots = nslots;
+    }
+}
+
+void slz_put_blob_interned(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
+{
+    slz_intern_t *intern = sink->intern;
+    assert (intern);
+
+    uint64_t hash = hash_bytes(data, len);
+    size_t i = 0, mask = intern->nslots - 1;
+    if (intern->nslots) {
+        for (i = hash & mask; intern->slots[i]; i = (i + 1) & mask) {
+            uint32_t id = intern->slots[i] - 1;
+            const entry_t *e = &intern->entries[id];
+            if (e->hash == hash && e->len == len &&
+                !memcmp(e->data, data, len)) {
+                slz_put_varuint(ctx, sink, 2 * (uint64_t) id + 1);
+                return;
+            }
+        }
+    }
+
+    slz_put_varuint(ctx, sink, 2 * (uint64_t) len);
+    slz_put_bytes(ctx, sink, len, data);
+    if (!fits(intern, len))
+        return;
+
+    size_t nslots = intern->nslots;
+    reserve_entry(ctx, intern, true);
+    if (intern->nslots != nslots) {
+        mask = intern->nslots - 1;
+        for (i = hash & mask; intern->slots[i]; i = (i + 1) & mask)
+            ;
+    }
+    char *copy = alloc_bytes(ctx, &intern->arena, len + 1);
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    entry_t *e = &intern->entries[intern->nentries];
+    e->data = copy;
+    e->len = len;
+    e->hash = hash;
+    intern->slots[i] = (uint32_t) ++intern->nentries;
+    intern->nbytes += len + 1;
+}
+
+void slz_put_str_interned(slz_ctx_t *ctx, slz_sink_t *sink, const char *str)
+{
+    slz_put_blob_interned(ctx, sink, strlen(str), str);
+}
+
+const char *slz_get_str_interned(
+    slz_ctx_t *ctx, slz_src_t *src, slz_arena_t *arena, size_t *lenp)
+{
+    slz_intern_t *intern = src->intern;
+    uint64_t tag = slz_get_varuint(ctx, src);
+    if (!intern || (tag & 1 && tag / 2 >= intern->nentries)) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+
+    if (tag & 1) {
+        const entry_t *e = &intern->entries[tag / 2];
+        if (lenp)
+            *lenp = e->len;
+        return e->data;
+    }
+
+    uint64_t len = tag / 2;
+    char *p;
+    if (fits(intern, len)) {
+        reserve_entry(ctx, intern, false);
+        p = get_blob_bytes(ctx, src, &intern->arena, len, 1);
+        entry_t *e = &intern->entries[intern->nentries++];
+        e->data = p;
+        e->len = (size_t) len;
+        e->hash = 0;
+        intern->nbytes += (size_t) len + 1;
+    }
+    else
+        p = get_blob_bytes(ctx, src, arena, len, 1);
+    p[len] = '\0';
+    if (lenp)
+        *lenp = (size_t) len;
+    return p;
+}
@@ -0,0 +1,424 @@
+/* Bulk encoding & decoding of arrays of fixed-width integers & floats.
+ *
+ * Converting between host order and the stream's (big-endian, unless the
+ * header says little; see SLZ_HEADER_LITTLE_ENDIAN) is the same operation in
+ * both directions: reverse each value's bytes if the orders differ, and copy
+ * them if not. So each width needs just one swapping kernel, which converts
+ * `n' values from `src' to `dst'; they may be the same, but must not
+ * otherwise overlap. Where the CPU has byte shuffles, we use them, 16 or 32
+ * bytes at a time.
+ *
+ * The byte-shuffled float & double arrays go a block at a time, each block
+ * being a byte transpose: `n' values of `width' bytes become `width' planes
+ * of `n' bytes, the most significant first. With SSSE3, we transpose 16
+ * values at once: a pshufb groups each vector's bytes by plane, and a round
+ * of unpacks per halving of the lane width finishes the transpose (which,
+ * being its own inverse, also undoes it).
+ */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN 1
+#endif
+
+typedef void swap_fn(void *dst, const void *src, size_t n);
+typedef void shuffle_fn(char *dst, const char *src, size_t n);
+
+/* Values per shuffled block; part of the format. */
+#define SHUFFLE_BLOCK 1024
+
+
+/* Scalar kernels. */
+#define BSWAP16(x) ((uint16_t) (((x) >> 8) | ((x) << 8)))
+#define BSWAP32(x) ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+                    (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#define BSWAP64(x) ((uint64_t) BSWAP32((uint32_t) (x)) << 32 |  \
+                    BSWAP32((uint32_t) ((x) >> 32)))
+
+#define DEFINE_SWAP_SCALAR(bits)                                        \
+    static void swap##bits##_scalar(void *dst, const void *src, size_t n) \
+    {                                                                   \
+        char *d = dst;                                                  \
+        const char *s = src;                                            \
+        for (size_t i = 0; i < n; ++i) {                                \
+            uint##bits##_t v;                                           \
+            memcpy(&v, s + i * sizeof v, sizeof v);                     \
+            v = BSWAP##bits(v);                                         \
+            memcpy(d + i * sizeof v, &v, sizeof v);                     \
+        }                                                               \
+    }
+
+DEFINE_SWAP_SCALAR(16)
+DEFINE_SWAP_SCALAR(32)
+DEFINE_SWAP_SCALAR(64)
+
+/* For values already in the stream's order. */
+#define DEFINE_COPY(bits)                                               \
+    static void copy##bits(void *dst, const void *src, size_t n)        \
+    {                                                                   \
+        if (dst != src)                                                 \
+            memcpy(dst, src, n * (bits / 8));                           \
+    }
+
+DEFINE_COPY(16)
+DEFINE_COPY(32)
+DEFINE_COPY(64)
+
+/* These do values [from, n) of a block, so that the SIMD kernels can leave
+ * them the odd ones at the end. Shifting rather than looking at the bytes in
+ * memory makes them independent of the host's byte order. */
+#define DEFINE_SHUFFLE_SCALAR(bits)                                     \
+    static void shuffle##bits##_from(                                   \
+        char *dst, const char *src, size_t n, size_t from)              \
+    {                                                                   \
+        for (size_t i = from; i < n; ++i) {                             \
+            uint##bits##_t v;                                           \
+            memcpy(&v, src + i * sizeof v, sizeof v);                   \
+            for (unsigned p = 0; p < sizeof v; ++p)                     \
+                dst[p * n + i] = (char) (v >> (bits - 8 - 8 * p));      \
+        }                                                               \
+    }                                                                   \
+    static void unshuffle##bits##_from(                                 \
+        char *dst, const char *src, size_t n, size_t from)              \
+    {                                                                   \
+        for (size_t i = from; i < n; ++i) {                             \
+            uint##bits##_t v = 0;                                       \
+            for (unsigned p = 0; p < sizeof v; ++p)                     \
+                v = v << 8 | (unsigned char) src[p * n + i];            \
+            memcpy(dst + i * sizeof v, &v, sizeof v);                   \
+        }                                                               \
+    }                                                                   \
+    static void shuffle##bits##_scalar(                                 \
+        char *dst, const char *src, size_t n)                           \
+    {                                                                   \
+        shuffle##bits##_from(dst, src, n, 0);                           \
+    }                                                                   \
+    static void unshuffle##bits##_scalar(                               \
+        char *dst, const char *src, size_t n)                           \
+    {                                                                   \
+        unshuffle##bits##_from(dst, src, n, 0);                         \
+    }
+
+DEFINE_SHUFFLE_SCALAR(32)
+DEFINE_SHUFFLE_SCALAR(64)
+
+
+/* SIMD kernels. x86 is little-endian, so these always swap. */
+#ifdef HAVE_X86_SIMD
+/* pshufb masks reversing each 2-, 4- and 8-byte lane of a 16-byte vector. */
+static const char masks[3][16] = {
+    {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+    {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+    {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8},
+};
+
+/* Swaps as many whole vectors' worth of values as it can; returns how many
+ * values that was. */
+__attribute__((target("ssse3")))
+static size_t swap_ssse3(
+    char *dst, const char *src, size_t n, size_t width, const char *mask)
+{
+    const __m128i m = _mm_loadu_si128((const __m128i*) mask);
+    size_t bytes = n * width / 16 * 16;
+    for (size_t i = 0; i < bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v, m));
+    }
+    return bytes / width;
+}
+
+__attribute__((target("avx2")))
+static size_t swap_avx2(
+    char *dst, const char *src, size_t n, size_t width, const char *mask)
+{
+    /* vpshufb shuffles within each 128-bit half, so the mask is repeated. */
+    const __m256i m = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*) mask));
+    size_t bytes = n * width / 32 * 32;
+    size_t i = 0;
+    /* Two vectors per iteration, to keep both shuffle ports busy. */
+    for (; i + 64 <= bytes; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*) (src + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*) (src + i + 32));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(v0, m));
+        _mm256_storeu_si256((__m256i*) (dst + i + 32),
+                            _mm256_shuffle_epi8(v1, m));
+    }
+    for (; i < bytes; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(v, m));
+    }
+    return bytes / width;
+}
+
+#define DEFINE_SWAP_SIMD(bits, isa, maskidx)                            \
+    static void swap##bits##_##isa(void *dst, const void *src, size_t n) \
+    {                                                                   \
+        size_t done = swap_##isa(dst, src, n, bits / 8, masks[maskidx]); \
+        swap##bits##_scalar((char*) dst + done * (bits / 8),            \
+                            (const char*) src + done * (bits / 8),      \
+                            n - done);                                  \
+    }
+
+DEFINE_SWAP_SIMD(16, ssse3, 0)
+DEFINE_SWAP_SIMD(32, ssse3, 1)
+DEFINE_SWAP_SIMD(64, ssse3, 2)
+DEFINE_SWAP_SIMD(16, avx2, 0)
+DEFINE_SWAP_SIMD(32, avx2, 1)
+DEFINE_SWAP_SIMD(64, avx2, 2)
+
+/* pshufb masks gathering byte plane j (the most significant byte first) of
+ * each 4- or 8-byte value into the jth 4- or 2-byte lane, and scattering it
+ * back. */
+static const char gather32[16] =
+    {3, 7, 11, 15, 2, 6, 10, 14, 1, 5, 9, 13, 0, 4, 8, 12};
+static const char scatter32[16] =
+    {12, 8, 4, 0, 13, 9, 5, 1, 14, 10, 6, 2, 15, 11, 7, 3};
+static const char gather64[16] =
+    {7, 15, 6, 14, 5, 13, 4, 12, 3, 11, 2, 10, 1, 9, 0, 8};
+static const char scatter64[16] =
+    {14, 12, 10, 8, 6, 4, 2, 0, 15, 13, 11, 9, 7, 5, 3, 1};
+
+/* Transposes 4x4 32-bit lanes: afterwards v[j] holds lane j of each. */
+__attribute__((target("ssse3")))
+static inline void transpose32(__m128i v[4])
+{
+    __m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+    __m128i t1 = _mm_unpackhi_epi32(v[0], v[1]);
+    __m128i t2 = _mm_unpacklo_epi32(v[2], v[3]);
+    __m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+    v[0] = _mm_unpacklo_epi64(t0, t2);
+    v[1] = _mm_unpackhi_epi64(t0, t2);
+    v[2] = _mm_unpacklo_epi64(t1, t3);
+    v[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+/* Likewise for 8x8 16-bit lanes. */
+__attribute__((target("ssse3")))
+static inline void transpose16(__m128i v[8])
+{
+    __m128i b[8], c[8];
+    for (unsigned k = 0; k < 8; k += 2) {
+        b[k] = _mm_unpacklo_epi16(v[k], v[k + 1]);
+        b[k + 1] = _mm_unpackhi_epi16(v[k], v[k + 1]);
+    }
+    for (unsigned k = 0; k < 8; k += 4) {
+        c[k] = _mm_unpacklo_epi32(b[k], b[k + 2]);
+        c[k + 1] = _mm_unpackhi_epi32(b[k], b[k + 2]);
+        c[k + 2] = _mm_unpacklo_epi32(b[k + 1], b[k + 3]);
+        c[k + 3] = _mm_unpackhi_epi32(b[k + 1], b[k + 3]);
+    }
+    for (unsigned k = 0; k < 4; ++k) {
+        v[2 * k] = _mm_unpacklo_epi64(c[k], c[k + 4]);
+        v[2 * k + 1] = _mm_unpackhi_epi64(c[k], c[k + 4]);
+    }
+}
+
+/* Each of these does 16 values at a time, the width in bytes being the number
+ * of vectors they take up, and of planes. */
+#define DEFINE_SHUFFLE_SIMD(bits, width, lanebits)                      \
+    __attribute__((target("ssse3")))                                    \
+    static void shuffle##bits##_ssse3(char *dst, const char *src, size_t n) \
+    {                                                                   \
+        const __m128i m = _mm_loadu_si128((const __m128i*) gather##bits); \
+        size_t i = 0;                                                   \
+        for (; i + 16 <= n; i += 16) {                                  \
+            __m128i v[width];                                           \
+            for (unsigned k = 0; k < width; ++k) {                      \
+                const char *in = src + (i + 16 / width * k) * width;    \
+                v[k] = _mm_shuffle_epi8(                                \
+                    _mm_loadu_si128((const __m128i*) in), m);           \
+            }                                                           \
+            transpose##lanebits(v);                                     \
+            for (unsigned p = 0; p < width; ++p)                        \
+                _mm_storeu_si128((__m128i*) (dst + p * n + i), v[p]);   \
+        }                                                               \
+        shuffle##bits##_from(dst, src, n, i);                           \
+    }                                                                   \
+    __attribute__((target("ssse3")))                                    \
+    static void unshuffle##bits##_ssse3(                                \
+        char *dst, const char *src, size_t n)                           \
+    {                                                                   \
+        const __m128i m = _mm_loadu_si128((const __m128i*) scatter##bits); \
+        size_t i = 0;                                                   \
+        for (; i + 16 <= n; i += 16) {                                  \
+            __m128i v[width];                                           \
+            for (unsigned p = 0; p < width; ++p)                        \
+                v[p] = _mm_loadu_si128((const __m128i*) (src + p * n + i)); \
+            transpose##lanebits(v);                                     \
+            for (unsigned k = 0; k < width; ++k)                        \
+                _mm_storeu_si128(                                       \
+                    (__m128i*) (dst + (i + 16 / width * k) * width),    \
+                    _mm_shuffle_epi8(v[k], m));                         \
+        }                                                               \
+        unshuffle##bits##_from(dst, src, n, i);                         \
+    }
+
+DEFINE_SHUFFLE_SIMD(32, 4, 32)
+DEFINE_SHUFFLE_SIMD(64, 8, 16)
+#endif
+
+
+/* Kernel selection. The scalar kernels are always safe; if the CPU can do
+ * better, we find out when the program starts. */
+static swap_fn *swap16 = swap16_scalar;
+static swap_fn *swap32 = swap32_scalar;
+static swap_fn *swap64 = swap64_scalar;
+static shuffle_fn *shuffle32 = shuffle32_scalar;
+static shuffle_fn *unshuffle32 = unshuffle32_scalar;
+static shuffle_fn *shuffle64 = shuffle64_scalar;
+static shuffle_fn *unshuffle64 = unshuffle64_scalar;
+
+#ifdef HAVE_X86_SIMD
+__attribute__((constructor))
+static void pick_kernels(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        swap16 = swap16_avx2;
+        swap32 = swap32_avx2;
+        swap64 = swap64_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        swap16 = swap16_ssse3;
+        swap32 = swap32_ssse3;
+        swap64 = swap64_ssse3;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        shuffle32 = shuffle32_ssse3;
+        unshuffle32 = unshuffle32_ssse3;
+        shuffle64 = shuffle64_ssse3;
+        unshuffle64 = unshuffle64_ssse3;
+    }
+}
+#endif
+
+
+/* Putting & getting arrays. */
+/* The kernel converting between host order and a stream's. */
+#ifdef HOST_BIG_ENDIAN
+#define CONVERT(bits, little_endian) ((little_endian) ? swap##bits : copy##bits)
+#else
+#define CONVERT(bits, little_endian) ((little_endian) ? copy##bits : swap##bits)
+#endif
+
+static void put_array(slz_ctx_t *ctx, slz_sink_t *sink,
+                      size_t n, const void *vals, size_t width, swap_fn *swap)
+{
+    const char *v = vals;
+    while (n) {
+        /* Encode as much as fits straight into the write buffer. Asking for
+         * more than SLZ_BUFSIZE would just make the buffer grow. */
+        size_t want = n * width < SLZ_BUFSIZE ? n * width : SLZ_BUFSIZE;
+        slz_sink_reserve(ctx, sink, want);
+        size_t k = (sink->end - sink->pos) / width;
+        if (k > n)
+            k = n;
+        swap(sink->pos, v, k);
+        sink->pos += k * width;
+        v += k * width;
+        n -= k;
+    }
+}
+
+static void get_array(slz_ctx_t *ctx, slz_src_t *src,
+                      size_t n, void *out, size_t width, swap_fn *swap)
+{
+    char *o = out;
+    while (n) {
+        size_t k = (src->end - src->pos) / width;
+        if (!k) {
+            /* Read big arrays (and anything from sources that can't read
+             * ahead) straight into `out', and convert them in place. */
+            if (!src->funcs->fill &&
+                (n * width >= SLZ_BUFSIZE || !src->funcs->read_some)) {
+                slz_get_bytes(ctx, src, n * width, o);
+                swap(o, o, n);
+                return;
+            }
+            slz_src_reserve(ctx, src, width);
+            continue;
+        }
+        if (k > n)
+            k = n;
+        swap(o, src->pos, k);
+        src->pos += k * width;
+        o += k * width;
+        n -= k;
+    }
+}
+
+#define DEFINE_ARRAY(name, type, bits)                                  \
+    void slz_put_##name##_array(                                        \
+        slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const type *vals)   \
+    {                                                                   \
+        put_array(ctx, sink, n, vals, bits / 8,                         \
+                  CONVERT(bits, sink->little_endian));                  \
+    }                                                                   \
+    void slz_get_##name##_array(                                        \
+        slz_ctx_t *ctx, slz_src_t *src, size_t n, type *out)            \
+    {                                                                   \
+        get_array(ctx, src, n, out, bits / 8,                           \
+                  CONVERT(bits, src->little_endian));                   \
+    }
+
+DEFINE_ARRAY(uint16, uint16_t, 16)
+DEFINE_ARRAY(int16,   int16_t, 16)
+DEFINE_ARRAY(uint32, uint32_t, 32)
+DEFINE_ARRAY(int32,   int32_t, 32)
+DEFINE_ARRAY(uint64, uint64_t, 64)
+DEFINE_ARRAY(int64,   int64_t, 64)
+DEFINE_ARRAY(float,     float, 32)
+DEFINE_ARRAY(double,   double, 64)
+
+static void put_shuffled(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                         const void *vals, size_t width, shuffle_fn *shuffle)
+{
+    const char *v = vals;
+    while (n) {
+        size_t k = n < SHUFFLE_BLOCK ? n : SHUFFLE_BLOCK;
+        slz_sink_reserve(ctx, sink, k * width);
+        shuffle(sink->pos, v, k);
+        sink->pos += k * width;
+        v += k * width;
+        n -= k;
+    }
+}
+
+static void get_shuffled(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                         void *out, size_t width, shuffle_fn *unshuffle)
+{
+    char *o = out;
+    while (n) {
+        size_t k = n < SHUFFLE_BLOCK ? n : SHUFFLE_BLOCK;
+        slz_src_reserve(ctx, src, k * width);
+        unshuffle(o, src->pos, k);
+        src->pos += k * width;
+        o += k * width;
+        n -= k;
+    }
+}
+
+#define DEFINE_SHUFFLED_ARRAY(name, type, bits)                         \
+    void slz_put_##name##_array_shuffled(                               \
+        slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const type *vals)   \
+    {                                                                   \
+        put_shuffled(ctx, sink, n, vals, bits / 8, shuffle##bits);      \
+    }                                                                   \
+    void slz_get_##name##_array_shuffled(                               \
+        slz_ctx_t *ctx, slz_src_t *src, size_t n, type *out)            \
+    {                                                                   \
+        get_shuffled(ctx, src, n, out, bits / 8, unshuffle##bits);      \
+    }
+
+DEFINE_SHUFFLED_ARRAY(float,   float, 32)
+DEFINE_SHUFFLED_ARRAY(double, double, 64)
@@ -0,0 +1,226 @@
+/* Asynchronous sinks: a background thread does the writing.
+ *
+ * The sink owns `nbufs' buffers. The serializing thread fills one (it's
+ * sink->buf), and when it's full, the flush hook queues it for the I/O thread
+ * and takes a free one, waiting for the I/O thread to finish one if there are
+ * none. So up to nbufs - 1 buffers can be waiting to be written while the
+ * next is filled; how far serialization may get ahead of the disk is the
+ * back-pressure knob.
+ *
+ * Once a write fails, the I/O thread remembers the error and discards the
+ * rest of what's queued, and the flush hook fails from then on, so that the
+ * error surfaces as an SLZ_IO_ERROR from whatever put next needs a buffer, or
+ * from slz_sink_flush.
+ */
+
+/* _POSIX_C_SOURCE for pthreads and XSI-compliant strerror_r, as in slz.c. */
+#define _POSIX_C_SOURCE 200112L
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_NBUFS 4
+#define DEFAULT_BUFSIZE (1024 * 1024)
+
+typedef struct {
+    char *data;
+    size_t len, size;
+} abuf_t;
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+    bool have_thread;
+    pthread_mutex_t lock;
+    /* `work' is signalled when a buffer is queued or we're to quit; `space'
+     * when the I/O thread has finished with one. */
+    pthread_cond_t work, space;
+    bool quit;
+    /* Buffers queue[head % nbufs] to queue[tail % nbufs] are waiting to be
+     * written, the one at `head' possibly being written as we speak. Free
+     * buffers are in free_bufs. */
+    abuf_t *queue, *free_bufs;
+    size_t head, tail, nfree, nbufs;
+    int saved_errno;            /* of the first failed write; 0 if none */
+    const slz_allocator_t *allocator;
+} async_t;
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+static void *io_thread(void *arg)
+{
+    async_t *obj = arg;
+    pthread_mutex_lock(&obj->lock);
+    for (;;) {
+        while (!obj->quit && obj->head == obj->tail)
+            pthread_cond_wait(&obj->work, &obj->lock);
+        if (obj->head == obj->tail)
+            break;
+
+        abuf_t *buf = &obj->queue[obj->head % obj->nbufs];
+        bool failed = obj->saved_errno != 0;
+        pthread_mutex_unlock(&obj->lock);
+
+        int saved_errno = 0;
+        if (!failed && !write_all(obj->fd, buf->data, buf->len))
+            saved_errno = errno;
+
+        pthread_mutex_lock(&obj->lock);
+        if (saved_errno && !obj->saved_errno)
+            obj->saved_errno = saved_errno;
+        obj->free_bufs[obj->nfree++] = *buf;
+        obj->head++;
+        pthread_cond_signal(&obj->space);
+    }
+    pthread_mutex_unlock(&obj->lock);
+    return NULL;
+}
+
+
+/* Vtable methods. */
+static bool async_write(void *obj, const char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* async_flush is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t async_strerror(void *objp, char *buf, size_t buflen)
+{
+    async_t *obj = objp;
+    return strerror_r(obj->saved_errno, buf, buflen) ? SIZE_MAX : 0;
+}
+
+/* Buffers already queued are still written. */
+static void async_free(void *objp)
+{
+    async_t *obj = objp;
+    if (obj->have_thread) {
+        pthread_mutex_lock(&obj->lock);
+        obj->quit = true;
+        pthread_cond_signal(&obj->work);
+        pthread_mutex_unlock(&obj->lock);
+        pthread_join(obj->thread, NULL);
+    }
+    pthread_cond_destroy(&obj->space);
+    pthread_cond_destroy(&obj->work);
+    pthread_mutex_destroy(&obj->lock);
+
+    /* The buffer in use, if any, is sink->buf, which isn't ours to free. */
+    for (size_t i = 0; i < obj->nfree; ++i)
+        slz_allocator_free(obj->allocator, obj->free_bufs[i].data);
+    slz_allocator_free(obj->allocator, obj->free_bufs);
+    slz_allocator_free(obj->allocator, obj->queue);
+    slz_allocator_free(obj->allocator, obj);
+}
+
+static bool async_flush(
+    slz_ctx_t *ctx, void *objp, slz_sink_t *sink, size_t need)
+{
+    async_t *obj = objp;
+    pthread_mutex_lock(&obj->lock);
+
+    if (sink->pos > sink->buf) {
+        abuf_t *buf = &obj->queue[obj->tail++ % obj->nbufs];
+        buf->data = sink->buf;
+        buf->len = sink->pos - sink->buf;
+        buf->size = sink->end - sink->buf;
+        sink->buf = sink->pos = sink->end = NULL;
+        pthread_cond_signal(&obj->work);
+    }
+
+    /* Wait for everything to be written, or for a buffer to fill. */
+    if (!need)
+        while (obj->head != obj->tail)
+            pthread_cond_wait(&obj->space, &obj->lock);
+    else if (!sink->buf) {
+        while (!obj->nfree)
+            pthread_cond_wait(&obj->space, &obj->lock);
+        abuf_t *buf = &obj->free_bufs[--obj->nfree];
+        sink->buf = sink->pos = buf->data;
+        sink->end = buf->data + buf->size;
+    }
+
+    bool ok = !obj->saved_errno;
+    pthread_mutex_unlock(&obj->lock);
+    if (!ok)
+        return false;
+
+    /* For puts bigger than a buffer. */
+    if ((size_t) (sink->end - sink->pos) < need) {
+        char *data = slz_try_malloc(ctx, need);
+        if (!data)
+            return false;
+        slz_free(ctx, sink->buf);
+        sink->buf = sink->pos = data;
+        sink->end = data + need;
+    }
+    return true;
+}
+
+static slz_sink_funcs_t async_sink_funcs = {
+    .write = async_write,
+    .strerror = async_strerror,
+    .free = async_free,
+    .flush = async_flush
+};
+
+
+/* Initializer. */
+void slz_sink_async_fd(slz_ctx_t *ctx, slz_sink_t *sink, int fd,
+                       size_t nbufs, size_t bufsize)
+{
+    nbufs = nbufs ? nbufs : DEFAULT_NBUFS;
+    nbufs = nbufs < 2 ? 2 : nbufs;
+    bufsize = bufsize ? bufsize : DEFAULT_BUFSIZE;
+
+    async_t *obj = slz_malloc(ctx, sizeof *obj);
+    obj->fd = fd;
+    obj->have_thread = obj->quit = false;
+    obj->head = obj->tail = obj->nfree = 0;
+    obj->nbufs = nbufs;
+    obj->saved_errno = 0;
+    obj->queue = obj->free_bufs = NULL;
+    obj->allocator = ctx->allocator;
+    pthread_mutex_init(&obj->lock, NULL);
+    pthread_cond_init(&obj->work, NULL);
+    pthread_cond_init(&obj->space, NULL);
+    slz_sink_init(ctx, sink, &async_sink_funcs, obj);
+
+    if (!(obj->queue = slz_try_malloc(ctx, nbufs * sizeof(abuf_t))) ||
+        !(obj->free_bufs = slz_try_malloc(ctx, nbufs * sizeof(abuf_t))))
+        slz_raise(ctx, SLZ_SINK, sink);
+    for (; obj->nfree < nbufs; obj->nfree++) {
+        abuf_t *buf = &obj->free_bufs[obj->nfree];
+        if (!(buf->data = slz_try_malloc(ctx, bufsize)))
+            slz_raise(ctx, SLZ_SINK, sink);
+        buf->len = 0;
+        buf->size = bufsize;
+    }
+
+    int err = pthread_create(&obj->thread, NULL, io_thread, obj);
+    if (err) {
+        /* As for slz_src_from_path, the caller still destroys `sink'. */
+        obj->saved_errno = err;
+        ctx->state = SLZ_IO_ERROR;
+        slz_raise(ctx, SLZ_SINK, sink);
+    }
+    obj->have_thread = true;
+}
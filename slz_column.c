@@ -0,0 +1,467 @@
+/* Record batches, stored a column at a time.
+ *
+ * A batch is a varuint row count and a varuint column count, followed by the
+ * columns, each of which starts with a kind byte:
+ *
+ *     KIND_FOR, KIND_DELTA, KIND_DELTA2: integers, as
+ *         `start' (0, 1 or 2, but no more than the row count) varint heads:
+ *             the first value, then for KIND_DELTA2 the first difference
+ *         varint reference
+ *         uint8 width (0 to 64)
+ *         the rest of the sequence (the values themselves, their differences,
+ *         or the differences of those), minus the reference, bit-packed
+ *     KIND_DOUBLE: doubles, as slz_put_double_array_shuffled
+ *
+ * Bit-packing goes in blocks of COLUMN_BLOCK values, each taking up
+ * ceil(n * width / 8) bytes; a value's bits go in least significant first,
+ * from the bottom of each byte up. That's always little-endian, whatever
+ * the header says (see SLZ_HEADER_LITTLE_ENDIAN), so that decoding a value
+ * is a little-endian load, a shift and a mask; with AVX2 we decode four at
+ * a time, gathering the loads. The arithmetic is all mod 2^64, so columns of
+ * any integer type share the kinds; signedness only changes which value is
+ * the minimum.
+ *
+ * The writer tries all three integer kinds and picks whichever packs
+ * smallest. Nothing records a column's length, but it follows from the row
+ * count and the heads, which is what lets readers skip columns they don't
+ * want (seeking, where the source can) for little more than their heads.
+ */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+enum {
+    KIND_FOR,
+    KIND_DELTA,
+    KIND_DELTA2,
+    KIND_DOUBLE,
+};
+
+/* Values per bit-packed block; part of the format. */
+#define COLUMN_BLOCK 1024
+
+#define SIGN_BIT ((uint64_t) 1 << 63)
+
+/* Reads & writes `k' values starting at index `from' of a strided column of
+ * some integer type, widened to (or narrowed from) uint64_t. */
+typedef void load_fn(uint64_t *dst, const char *base, size_t stride,
+                     size_t from, size_t k);
+typedef void store_fn(char *base, size_t stride, size_t from,
+                      const uint64_t *vals, size_t k);
+
+
+/* Batches. */
+void slz_put_batch(slz_ctx_t *ctx, slz_sink_t *sink,
+                   uint64_t nrows, uint64_t ncols)
+{
+    slz_put_varuint(ctx, sink, nrows);
+    slz_put_varuint(ctx, sink, ncols);
+}
+
+slz_batch_t slz_get_batch(slz_ctx_t *ctx, slz_src_t *src)
+{
+    slz_batch_t batch;
+    batch.nrows = slz_get_varuint(ctx, src);
+    batch.ncols = slz_get_varuint(ctx, src);
+    return batch;
+}
+
+
+/* Bit-packing. */
+static unsigned bit_width(uint64_t v) {
+    return v ? 64 - (unsigned) __builtin_clzll(v) : 0;
+}
+
+static size_t packed_len(size_t n, unsigned width) {
+    return (size_t) (((uint64_t) n * width + 7) / 8);
+}
+
+/* The packed length of a whole column of `n' values. */
+static uint64_t column_packed_len(uint64_t n, unsigned width)
+{
+    return n / COLUMN_BLOCK * packed_len(COLUMN_BLOCK, width) +
+        packed_len(n % COLUMN_BLOCK, width);
+}
+
+/* Loads `len' (at most 8) bytes, little-endian. */
+static inline uint64_t load_le(const unsigned char *p, size_t len)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+    }
+#endif
+    uint64_t v = 0;
+    for (size_t b = 0; b < len && b < 8; ++b)
+        v |= (uint64_t) p[b] << (8 * b);
+    return v;
+}
+
+/* Packs `k' values of `width' bits into `out', which must have room for
+ * packed_len(k, width) bytes. */
+static void pack(char *out, const uint64_t *vals, size_t k, unsigned width)
+{
+    unsigned char *p = (unsigned char*) out;
+    uint64_t acc = 0;
+    unsigned nbits = 0;
+    if (!width)
+        return;
+    for (size_t i = 0; i < k; ++i) {
+        acc |= vals[i] << nbits;
+        if (nbits + width < 64) {
+            nbits += width;
+            continue;
+        }
+        for (unsigned b = 0; b < 8; ++b)
+            *p++ = (unsigned char) (acc >> (8 * b));
+        acc = nbits ? vals[i] >> (64 - nbits) : 0;
+        nbits = nbits + width - 64;
+    }
+    for (unsigned b = 0; b < nbits; b += 8)
+        *p++ = (unsigned char) (acc >> b);
+}
+
+/* Unpacks values [from, k) of a block of `len' bytes, adding `ref' to each. */
+static void unpack_scalar(uint64_t *out, const unsigned char *p, size_t len,
+                          size_t from, size_t k, unsigned width, uint64_t ref)
+{
+    uint64_t mask = width == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << width) - 1;
+    for (size_t i = from; i < k; ++i) {
+        uint64_t bit = (uint64_t) i * width;
+        size_t o = (size_t) (bit / 8);
+        unsigned shift = (unsigned) (bit % 8);
+        uint64_t v = load_le(p + o, len - o) >> shift;
+        /* Over 56 bits, a value can straddle nine bytes. */
+        if (shift + width > 64)
+            v |= (uint64_t) p[o + 8] << (64 - shift);
+        out[i] = (v & mask) + ref;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Four values at a time, while the 8-byte loads stay within the block; only
+ * for widths up to 56, so that a load always covers a whole value. Returns
+ * how many values it unpacked. */
+__attribute__((target("avx2")))
+static size_t unpack_avx2(uint64_t *out, const unsigned char *p, size_t len,
+                          size_t k, unsigned width, uint64_t ref)
+{
+    const __m256i mask = _mm256_set1_epi64x(
+        (long long) (((uint64_t) 1 << width) - 1));
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i step = _mm256_set1_epi64x(4 * (long long) width);
+    const __m256i refv = _mm256_set1_epi64x((long long) ref);
+    __m256i bits = _mm256_setr_epi64x(
+        0, width, 2 * (long long) width, 3 * (long long) width);
+    size_t i = 0;
+    for (; i + 4 <= k && (i + 3) * width / 8 + 8 <= len; i += 4) {
+        __m256i v = _mm256_i64gather_epi64(
+            (const long long*) p, _mm256_srli_epi64(bits, 3), 1);
+        v = _mm256_srlv_epi64(v, _mm256_and_si256(bits, seven));
+        v = _mm256_add_epi64(_mm256_and_si256(v, mask), refv);
+        _mm256_storeu_si256((__m256i*) (out + i), v);
+        bits = _mm256_add_epi64(bits, step);
+    }
+    return i;
+}
+
+static bool have_avx2;
+
+__attribute__((constructor))
+static void pick_kernels(void)
+{
+    __builtin_cpu_init();
+    have_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+static void unpack(uint64_t *out, const char *in, size_t k, unsigned width,
+                   uint64_t ref)
+{
+    const unsigned char *p = (const unsigned char*) in;
+    size_t len = packed_len(k, width), done = 0;
+    if (!width) {
+        for (size_t i = 0; i < k; ++i)
+            out[i] = ref;
+        return;
+    }
+#ifdef HAVE_X86_SIMD
+    if (have_avx2 && width <= 56)
+        done = unpack_avx2(out, p, len, k, width, ref);
+#endif
+    unpack_scalar(out, p, len, done, k, width, ref);
+}
+
+
+/* Integer columns. */
+typedef struct {
+    uint64_t min, max;
+} range_t;
+
+/* Range tracking, in the order given by xor-ing with `bias': SIGN_BIT for
+ * signed comparison, 0 for unsigned. */
+static void range_add(range_t *r, uint64_t v, uint64_t bias)
+{
+    if ((v ^ bias) < (r->min ^ bias))
+        r->min = v;
+    if ((v ^ bias) > (r->max ^ bias))
+        r->max = v;
+}
+
+/* Turns values [from - start, from + k) into the `k' members of the kind's
+ * sequence from `from' on, in place. */
+static void transform(uint64_t *v, size_t k, unsigned kind)
+{
+    if (kind == KIND_DELTA)
+        for (size_t i = 0; i < k; ++i)
+            v[i] = v[i + 1] - v[i];
+    else if (kind == KIND_DELTA2)
+        for (size_t i = 0; i < k; ++i)
+            v[i] = v[i + 2] - 2 * v[i + 1] + v[i];
+}
+
+static void put_int_column(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                           const char *base, size_t stride, load_fn *load,
+                           uint64_t bias)
+{
+    uint64_t block[COLUMN_BLOCK + 2];
+
+    /* Find the range of the values, and of their first & second
+     * differences. */
+    range_t ranges[3];
+    uint64_t prev = 0, prev_d = 0;
+    for (size_t i = 0; i < n; i += COLUMN_BLOCK) {
+        size_t k = n - i < COLUMN_BLOCK ? n - i : COLUMN_BLOCK;
+        load(block, base, stride, i, k);
+        for (size_t j = 0; j < k; ++j) {
+            uint64_t v = block[j], d = v - prev, dd = d - prev_d;
+            if (i + j == 0)
+                ranges[KIND_FOR].min = ranges[KIND_FOR].max = v;
+            range_add(&ranges[KIND_FOR], v, bias);
+            if (i + j == 1)
+                ranges[KIND_DELTA].min = ranges[KIND_DELTA].max = d;
+            if (i + j >= 1)
+                range_add(&ranges[KIND_DELTA], d, SIGN_BIT);
+            if (i + j == 2)
+                ranges[KIND_DELTA2].min = ranges[KIND_DELTA2].max = dd;
+            if (i + j >= 2)
+                range_add(&ranges[KIND_DELTA2], dd, SIGN_BIT);
+            prev = v;
+            prev_d = d;
+        }
+    }
+
+    /* Each head costs about as much as a full-width value; ties go to the
+     * simpler kind, which is quicker to decode. */
+    unsigned kind = KIND_FOR, width = 0;
+    uint64_t best = UINT64_MAX;
+    for (unsigned c = KIND_FOR; c <= KIND_DELTA2 && c <= n; ++c) {
+        unsigned w = c < n ? bit_width(ranges[c].max - ranges[c].min) : 0;
+        uint64_t cost = (uint64_t) (n - c) * w + 64 * c;
+        if (cost < best) {
+            best = cost;
+            kind = c;
+            width = w;
+        }
+    }
+    size_t start = kind;
+    uint64_t ref = start < n ? ranges[kind].min : 0;
+
+    slz_put_uint8(ctx, sink, (uint8_t) kind);
+    if (start) {
+        load(block, base, stride, 0, start);
+        slz_put_varint(ctx, sink, (int64_t) block[0]);
+        if (start > 1)
+            slz_put_varint(ctx, sink, (int64_t) (block[1] - block[0]));
+    }
+    slz_put_varint(ctx, sink, (int64_t) ref);
+    slz_put_uint8(ctx, sink, (uint8_t) width);
+
+    for (size_t i = start; i < n; i += COLUMN_BLOCK) {
+        size_t k = n - i < COLUMN_BLOCK ? n - i : COLUMN_BLOCK;
+        load(block, base, stride, i - start, k + start);
+        transform(block, k, kind);
+        for (size_t j = 0; j < k; ++j)
+            block[j] -= ref;
+        size_t len = packed_len(k, width);
+        pack(slz_sink_reserve(ctx, sink, len), block, k, width);
+        sink->pos += len;
+    }
+}
+
+/* The head of an integer column, up to and including the width. */
+typedef struct {
+    unsigned kind, width;
+    uint64_t first, first_d, ref;
+} int_head_t;
+
+static unsigned get_kind(slz_ctx_t *ctx, slz_src_t *src)
+{
+    unsigned kind = slz_get_uint8(ctx, src);
+    if (kind > KIND_DOUBLE) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+    return kind;
+}
+
+static void get_int_head(slz_ctx_t *ctx, slz_src_t *src, uint64_t n,
+                         unsigned kind, int_head_t *head)
+{
+    head->kind = kind;
+    head->first = head->first_d = 0;
+    if (kind > KIND_FOR && n)
+        head->first = (uint64_t) slz_get_varint(ctx, src);
+    if (kind > KIND_DELTA && n > 1)
+        head->first_d = (uint64_t) slz_get_varint(ctx, src);
+    head->ref = (uint64_t) slz_get_varint(ctx, src);
+    head->width = slz_get_uint8(ctx, src);
+    if (head->width > 64) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+}
+
+static void get_int_column(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                           char *base, size_t stride, store_fn *store)
+{
+    uint64_t block[COLUMN_BLOCK];
+    int_head_t head;
+    unsigned kind = get_kind(ctx, src);
+    if (kind == KIND_DOUBLE) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+    get_int_head(ctx, src, n, kind, &head);
+
+    /* Undoing the differences needs the previous value & difference. */
+    size_t start = kind < n ? kind : n;
+    uint64_t prev = head.first, prev_d = head.first_d;
+    if (start > 1)
+        prev = head.first + head.first_d;
+    block[0] = head.first;
+    block[1] = prev;
+    store(base, stride, 0, block, start);
+
+    for (size_t i = start; i < n; i += COLUMN_BLOCK) {
+        size_t k = n - i < COLUMN_BLOCK ? n - i : COLUMN_BLOCK;
+        size_t len = packed_len(k, head.width);
+        unpack(block, slz_src_peek(ctx, src, len), k, head.width, head.ref);
+        src->pos += len;
+        if (kind == KIND_DELTA)
+            for (size_t j = 0; j < k; ++j)
+                block[j] = prev += block[j];
+        else if (kind == KIND_DELTA2)
+            for (size_t j = 0; j < k; ++j)
+                block[j] = prev += prev_d += block[j];
+        store(base, stride, i, block, k);
+    }
+}
+
+#define DEFINE_INT_COLUMN(name, type, bias)                             \
+    static void load_##name(uint64_t *dst, const char *base, size_t stride, \
+                            size_t from, size_t k)                      \
+    {                                                                   \
+        for (size_t i = 0; i < k; ++i) {                                \
+            type v;                                                     \
+            memcpy(&v, base + (from + i) * stride, sizeof v);           \
+            dst[i] = (uint64_t) v;                                      \
+        }                                                               \
+    }                                                                   \
+    static void store_##name(char *base, size_t stride, size_t from,    \
+                             const uint64_t *vals, size_t k)            \
+    {                                                                   \
+        for (size_t i = 0; i < k; ++i) {                                \
+            type v = (type) vals[i];                                    \
+            memcpy(base + (from + i) * stride, &v, sizeof v);           \
+        }                                                               \
+    }                                                                   \
+    void slz_put_column_##name(slz_ctx_t *ctx, slz_sink_t *sink, size_t n, \
+                               const type *vals, size_t stride)         \
+    {                                                                   \
+        put_int_column(ctx, sink, n, (const char*) vals, stride,        \
+                       load_##name, bias);                              \
+    }                                                                   \
+    void slz_get_column_##name(slz_ctx_t *ctx, slz_src_t *src, size_t n, \
+                               type *out, size_t stride)                \
+    {                                                                   \
+        get_int_column(ctx, src, n, (char*) out, stride, store_##name); \
+    }
+
+DEFINE_INT_COLUMN(uint32, uint32_t, 0)
+DEFINE_INT_COLUMN(int32,   int32_t, SIGN_BIT)
+DEFINE_INT_COLUMN(uint64, uint64_t, 0)
+DEFINE_INT_COLUMN(int64,   int64_t, SIGN_BIT)
+
+
+/* Double columns. */
+void slz_put_column_double(slz_ctx_t *ctx, slz_sink_t *sink, size_t n,
+                           const double *vals, size_t stride)
+{
+    const char *base = (const char*) vals;
+    slz_put_uint8(ctx, sink, KIND_DOUBLE);
+    if (stride == sizeof(double)) {
+        slz_put_double_array_shuffled(ctx, sink, n, vals);
+        return;
+    }
+
+    /* Gathering a shuffle block at a time keeps the layout the same. */
+    double block[COLUMN_BLOCK];
+    for (size_t i = 0; i < n; i += COLUMN_BLOCK) {
+        size_t k = n - i < COLUMN_BLOCK ? n - i : COLUMN_BLOCK;
+        for (size_t j = 0; j < k; ++j)
+            memcpy(&block[j], base + (i + j) * stride, sizeof(double));
+        slz_put_double_array_shuffled(ctx, sink, k, block);
+    }
+}
+
+void slz_get_column_double(slz_ctx_t *ctx, slz_src_t *src, size_t n,
+                           double *out, size_t stride)
+{
+    char *base = (char*) out;
+    if (get_kind(ctx, src) != KIND_DOUBLE) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+    if (stride == sizeof(double)) {
+        slz_get_double_array_shuffled(ctx, src, n, out);
+        return;
+    }
+
+    double block[COLUMN_BLOCK];
+    for (size_t i = 0; i < n; i += COLUMN_BLOCK) {
+        size_t k = n - i < COLUMN_BLOCK ? n - i : COLUMN_BLOCK;
+        slz_get_double_array_shuffled(ctx, src, k, block);
+        for (size_t j = 0; j < k; ++j)
+            memcpy(base + (i + j) * stride, &block[j], sizeof(double));
+    }
+}
+
+
+/* Skipping. */
+void slz_skip_column(slz_ctx_t *ctx, slz_src_t *src, uint64_t n)
+{
+    unsigned kind = get_kind(ctx, src);
+    if (kind == KIND_DOUBLE) {
+        if (n > UINT64_MAX / sizeof(double)) {
+            ctx->state = SLZ_MALFORMED;
+            slz_raise(ctx, SLZ_SRC, src);
+        }
+        slz_skip_bytes(ctx, src, n * sizeof(double));
+        return;
+    }
+
+    int_head_t head;
+    get_int_head(ctx, src, n, kind, &head);
+    uint64_t start = kind < n ? kind : n;
+    slz_skip_bytes(ctx, src, column_packed_len(n - start, head.width));
+}
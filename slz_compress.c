@@ -0,0 +1,365 @@
+/* Block compression, as a sink & source that filter another sink or source.
+ *
+ * The compressing sink cuts what's written to it into blocks of at most
+ * BLOCK_SIZE bytes, each of which it writes to the underlying sink as:
+ *
+ *     uint32 uncompressed length (1 to BLOCK_SIZE)
+ *     uint32 compressed length (at most the uncompressed length)
+ *     the compressed bytes
+ *
+ * A block whose compressed length equals its uncompressed length is stored as
+ * is, since compressing it didn't help.
+ *
+ * The codec is a plain byte-oriented LZ77, in the same spirit (and the same
+ * sequence layout) as LZ4's block format: a sequence is a token byte, holding
+ * a 4-bit literal count and a 4-bit match length less MIN_MATCH, where 15
+ * means more follows in 255-valued bytes; then the literals; then a 2-byte
+ * little-endian match offset, and the rest of the match length. The last
+ * sequence of a block has literals only. Matches are found with a single-entry
+ * hash table, which is fast rather than thorough; decoding is a loop of
+ * memcpys.
+ */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Offsets are 16-bit, so there's no point in bigger blocks. */
+#define BLOCK_SIZE (64 * 1024)
+#define BLOCK_HEADER_LEN 8
+
+#define MIN_MATCH 4
+/* As in LZ4, the last match must start at least MATCH_LIMIT bytes before the
+ * end of the block, and the last LAST_LITERALS bytes are always literals. This
+ * keeps most of the decoder's copies far enough from the end of the block to
+ * be done in whole 16-byte pieces. */
+#define MATCH_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_OFFSET 65535
+#define HASH_LOG 13
+
+
+/* The codec. */
+static inline uint32_t load32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Worst case: all literals, with a length byte per 255 of them. */
+static size_t compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static unsigned char *put_sequence(
+    unsigned char *op, const unsigned char *lit, size_t nlit,
+    size_t offset, size_t match_len)
+{
+    unsigned char *token = op++;
+    *token = (unsigned char) ((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+        op = put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!match_len)
+        return op;
+
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) (offset >> 8);
+    match_len -= MIN_MATCH;
+    *token |= (unsigned char) (match_len < 15 ? match_len : 15);
+    if (match_len >= 15)
+        op = put_length(op, match_len - 15);
+    return op;
+}
+
+/* Compresses the `len' (at most BLOCK_SIZE) bytes at `src' into `dst', which
+ * must have room for compress_bound(len) bytes. Returns the compressed
+ * length. `table' is scratch space of 1 << HASH_LOG entries. */
+static size_t compress_block(
+    const char *src, size_t len, char *dst, uint32_t *table)
+{
+    const unsigned char *base = (const unsigned char*) src;
+    const unsigned char *ip = base, *anchor = base;
+    const unsigned char *end = base + len;
+    unsigned char *op = (unsigned char*) dst;
+
+    if (len > MATCH_LIMIT) {
+        const unsigned char *limit = end - MATCH_LIMIT;
+        const unsigned char *match_end = end - LAST_LITERALS;
+        memset(table, 0, sizeof(uint32_t) << HASH_LOG);
+        ip++;
+
+        while (ip < limit) {
+            uint32_t seq = load32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint32_t) (ip - base);
+            if (ip - ref > MAX_OFFSET || load32(ref) != seq) {
+                /* Skip faster through data that isn't compressing. */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+                ip--, ref--;
+            const unsigned char *p = ip + MIN_MATCH;
+            const unsigned char *q = ref + MIN_MATCH;
+            while (p < match_end && *p == *q)
+                p++, q++;
+
+            op = put_sequence(op, anchor, ip - anchor, ip - ref, p - ip);
+            anchor = ip = p;
+            table[hash4(load32(ip - 2))] = (uint32_t) (ip - 2 - base);
+        }
+    }
+
+    op = put_sequence(op, anchor, end - anchor, 0, 0);
+    return (char*) op - dst;
+}
+
+/* Reads a length continued in 255-valued bytes onto `len'. */
+static inline bool get_length(
+    const unsigned char **ipp, const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+    do {
+        if (ip == iend)
+            return false;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return true;
+}
+
+/* Decompresses `len' bytes at `src' into the `out_len' bytes at `dst'.
+ * Returns false unless the input is well-formed and fills `dst' exactly. */
+static bool decompress_block(
+    const char *src, size_t len, char *dst, size_t out_len)
+{
+    const unsigned char *ip = (const unsigned char*) src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char*) dst;
+    unsigned char *const obase = op, *const oend = op + out_len;
+
+    for (;;) {
+        if (ip == iend)
+            return false;
+        unsigned token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !get_length(&ip, iend, &nlit))
+            return false;
+        if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else if (nlit <= (size_t) (iend - ip) &&
+                 nlit <= (size_t) (oend - op))
+            memcpy(op, ip, nlit);
+        else
+            return false;
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend)
+            return op == oend;  /* the last sequence */
+
+        if (iend - ip < 2)
+            return false;
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(&ip, iend, &match_len))
+            return false;
+        match_len += MIN_MATCH;
+        if (!offset || offset > (size_t) (op - obase) ||
+            match_len > (size_t) (oend - op))
+            return false;
+
+        /* Pieces no bigger than the offset never overlap, and may overrun
+         * the match, but never the output. */
+        const unsigned char *ref = op - offset;
+        if (offset >= 16 && (size_t) (oend - op) >= match_len + 16) {
+            for (size_t i = 0; i < match_len; i += 16)
+                memcpy(op + i, ref + i, 16);
+            op += match_len;
+        }
+        else if (offset >= 8 && (size_t) (oend - op) >= match_len + 8) {
+            for (size_t i = 0; i < match_len; i += 8)
+                memcpy(op + i, ref + i, 8);
+            op += match_len;
+        }
+        else {
+            /* Overlapping: [ref, op) repeats, and doubles with each copy. */
+            while (match_len) {
+                size_t n = (size_t) (op - ref);
+                n = n < match_len ? n : match_len;
+                memcpy(op, ref, n);
+                op += n;
+                match_len -= n;
+            }
+        }
+    }
+}
+
+
+/* Compressing sinks. */
+typedef struct {
+    slz_sink_t *inner;
+    const slz_allocator_t *allocator;
+    uint32_t table[1 << HASH_LOG];
+} lz_sink_t;
+
+static bool lz_write(void *obj, const char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* lz_flush is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+/* Errors writing to the underlying sink are reported as if they were ours. */
+static size_t lz_sink_strerror(void *objp, char *buf, size_t buflen)
+{
+    lz_sink_t *obj = objp;
+    return obj->inner->funcs->strerror(obj->inner->obj, buf, buflen);
+}
+
+static void lz_sink_free(void *objp) {
+    lz_sink_t *obj = objp;
+    slz_allocator_free(obj->allocator, obj);
+}
+
+static bool write_block(slz_ctx_t *ctx, lz_sink_t *obj,
+                        const char *data, size_t len)
+{
+    slz_sink_t *inner = obj->inner;
+    if (!slz_sink_try_reserve(
+            ctx, inner, BLOCK_HEADER_LEN + compress_bound(len)))
+        return false;
+
+    char *block = inner->pos;
+    size_t clen = compress_block(
+        data, len, block + BLOCK_HEADER_LEN, obj->table);
+    if (clen >= len) {
+        memcpy(block + BLOCK_HEADER_LEN, data, len);
+        clen = len;
+    }
+    slz_store_be32(block, (uint32_t) len);
+    slz_store_be32(block + 4, (uint32_t) clen);
+    inner->pos += BLOCK_HEADER_LEN + clen;
+    return true;
+}
+
+static bool lz_flush(slz_ctx_t *ctx, void *objp, slz_sink_t *sink, size_t need)
+{
+    lz_sink_t *obj = objp;
+    for (char *p = sink->buf; p < sink->pos; p += BLOCK_SIZE) {
+        size_t left = sink->pos - p;
+        if (!write_block(ctx, obj, p, left < BLOCK_SIZE ? left : BLOCK_SIZE))
+            return false;
+    }
+    sink->pos = sink->buf;
+
+    if (!need)
+        return slz_sink_try_flush(ctx, obj->inner);
+    return slz_sink_try_alloc(ctx, sink, need, BLOCK_SIZE);
+}
+
+static slz_sink_funcs_t lz_sink_funcs = {
+    .write = lz_write,
+    .strerror = lz_sink_strerror,
+    .free = lz_sink_free,
+    .flush = lz_flush
+};
+
+void slz_sink_compress(slz_ctx_t *ctx, slz_sink_t *sink, slz_sink_t *inner)
+{
+    lz_sink_t *obj = slz_malloc(ctx, sizeof *obj);
+    obj->inner = inner;
+    obj->allocator = ctx->allocator;
+    slz_sink_init(ctx, sink, &lz_sink_funcs, obj);
+    sink->little_endian = inner->little_endian;
+}
+
+
+/* Decompressing sources. The object is just the underlying source. */
+static bool lz_read(void *obj, char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* lz_fill is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t lz_src_strerror(void *obj, char *buf, size_t buflen)
+{
+    slz_src_t *inner = obj;
+    return inner->funcs->strerror(inner->obj, buf, buflen);
+}
+
+static void lz_src_free(void *obj) { (void) obj; }
+
+static bool malformed(slz_ctx_t *ctx)
+{
+    ctx->state = SLZ_MALFORMED;
+    return false;
+}
+
+static bool lz_fill(slz_ctx_t *ctx, void *obj, slz_src_t *src, size_t need)
+{
+    slz_src_t *inner = obj;
+    size_t have = src->end - src->pos;
+
+    while (have < need) {
+        uint32_t len = slz_try_get_be32(ctx, inner);
+        uint32_t clen = slz_try_get_be32(ctx, inner);
+        if (!slz_ok(ctx))
+            return false;
+        if (!len || len > BLOCK_SIZE || clen > len)
+            return malformed(ctx);
+
+        /* Decode the block straight into the window, after what's left. */
+        if (!slz_src_try_compact(
+                ctx, src, len, need > BLOCK_SIZE ? need : BLOCK_SIZE))
+            return false;
+
+        if (clen == len)
+            slz_try_get_bytes(ctx, inner, len, src->buf + have);
+        else {
+            const char *block = slz_try_get_bytes_view(ctx, inner, clen);
+            if (block && !decompress_block(block, clen, src->buf + have, len))
+                return malformed(ctx);
+        }
+        if (!slz_ok(ctx))
+            return false;
+        have += len;
+        src->end = src->buf + have;
+    }
+    return true;
+}
+
+static slz_src_funcs_t lz_src_funcs = {
+    .read = lz_read,
+    .strerror = lz_src_strerror,
+    .free = lz_src_free,
+    .fill = lz_fill
+};
+
+void slz_src_decompress(slz_ctx_t *ctx, slz_src_t *src, slz_src_t *inner)
+{
+    slz_src_init(ctx, src, &lz_src_funcs, inner);
+    src->little_endian = inner->little_endian;
+}
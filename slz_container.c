@@ -0,0 +1,283 @@
+/* Seekable containers.
+ *
+ * A container is a sequence of chunks, each holding whole records, followed
+ * by an index of where each chunk starts:
+ *
+ *     chunk:    uint32 payload length (never 0)
+ *               uint32 number of records
+ *               payload: for each record, uint32 length, then its bytes
+ *     footer:   uint32 0, marking the end of the chunks
+ *               uint64 number of chunks
+ *               uint64 number of records
+ *               for each chunk: uint64 ordinal of its first record,
+ *                               uint64 offset from the start of the container
+ *     trailer:  uint64 length of the chunks (ie. offset of the footer)
+ *               uint64 length of the whole container
+ *               "slzindex"
+ *
+ * So a container can be read sequentially, up to the end-of-chunks marker,
+ * or, given the whole of it, indexed from the end.
+ */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <string.h>
+
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define CHUNK_HEADER_LEN SLZ_CHUNK_HEADER_LEN
+#define INDEX_ENTRY_LEN 16
+#define FOOTER_FIXED_LEN (4 + 8 + 8)
+#define TRAILER_LEN (8 + 8 + 8)
+
+static const char trailer_magic[8] = "slzindex";
+
+
+/* Writing. */
+void slz_container_writer_init(slz_ctx_t *ctx, slz_container_writer_t *w,
+                               slz_sink_t *out, size_t chunk_size)
+{
+    w->out = out;
+    slz_sink_to_memory(ctx, &w->chunk);
+    w->chunk_size = chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE;
+    w->offset = 0;
+    w->nrecords = 0;
+    w->chunk_first = 0;
+    w->record_start = SIZE_MAX;
+    w->index = NULL;
+    w->nchunks = w->index_cap = 0;
+}
+
+void slz_container_writer_destroy(slz_ctx_t *ctx, slz_container_writer_t *w)
+{
+    slz_sink_destroy(ctx, &w->chunk);
+    slz_free(ctx, w->index);
+}
+
+static bool try_add_to_index(slz_ctx_t *ctx, slz_container_writer_t *w,
+                             uint64_t first, uint64_t offset)
+{
+    if (w->nchunks == w->index_cap) {
+        size_t cap = w->index_cap ? 2 * w->index_cap : 64;
+        uint64_t *index = slz_try_malloc(ctx, cap * 2 * sizeof(uint64_t));
+        if (!index)
+            return false;
+        if (w->nchunks)
+            memcpy(index, w->index, w->nchunks * 2 * sizeof(uint64_t));
+        slz_free(ctx, w->index);
+        w->index = index;
+        w->index_cap = cap;
+    }
+    w->index[2 * w->nchunks] = first;
+    w->index[2 * w->nchunks + 1] = offset;
+    w->nchunks++;
+    return true;
+}
+
+bool slz_container_try_add_chunk(slz_ctx_t *ctx, slz_container_writer_t *w,
+                                 uint64_t first, size_t len)
+{
+    if (!try_add_to_index(ctx, w, first, w->offset))
+        return false;
+    w->offset += CHUNK_HEADER_LEN + len;
+    return true;
+}
+
+static void emit_chunk(slz_ctx_t *ctx, slz_container_writer_t *w)
+{
+    size_t len = w->chunk.pos - w->chunk.buf;
+    uint64_t count = w->nrecords - w->chunk_first;
+    if (!count)
+        return;
+    assert (len <= UINT32_MAX && count <= UINT32_MAX);
+
+    slz_put_be32(ctx, w->out, (uint32_t) len);
+    slz_put_be32(ctx, w->out, (uint32_t) count);
+    slz_put_bytes(ctx, w->out, len, w->chunk.buf);
+    if (!slz_container_try_add_chunk(ctx, w, w->chunk_first, len))
+        slz_reraise(ctx);
+
+    w->chunk_first = w->nrecords;
+    w->chunk.pos = w->chunk.buf; /* keep the buffer for the next chunk */
+}
+
+slz_sink_t *slz_container_begin_record(
+    slz_ctx_t *ctx, slz_container_writer_t *w)
+{
+    assert (w->record_start == SIZE_MAX);
+    w->record_start = w->chunk.pos - w->chunk.buf;
+    slz_put_be32(ctx, &w->chunk, 0); /* length; filled in later */
+    /* Records are payload, in whatever order `out' is. */
+    w->chunk.little_endian = w->out->little_endian;
+    return &w->chunk;
+}
+
+void slz_container_end_record(slz_ctx_t *ctx, slz_container_writer_t *w)
+{
+    assert (w->record_start != SIZE_MAX);
+    size_t len = w->chunk.pos - w->chunk.buf - w->record_start - 4;
+    assert (len <= UINT32_MAX);
+    slz_store_be32(w->chunk.buf + w->record_start, (uint32_t) len);
+    w->record_start = SIZE_MAX;
+    w->nrecords++;
+
+    if ((size_t) (w->chunk.pos - w->chunk.buf) >= w->chunk_size)
+        emit_chunk(ctx, w);
+}
+
+void slz_container_end_chunk(slz_ctx_t *ctx, slz_container_writer_t *w)
+{
+    assert (w->record_start == SIZE_MAX);
+    emit_chunk(ctx, w);
+}
+
+void slz_container_writer_finish(slz_ctx_t *ctx, slz_container_writer_t *w)
+{
+    assert (w->record_start == SIZE_MAX);
+    emit_chunk(ctx, w);
+
+    slz_put_be32(ctx, w->out, 0);
+    slz_put_be64(ctx, w->out, w->nchunks);
+    slz_put_be64(ctx, w->out, w->nrecords);
+    for (size_t i = 0; i < 2 * w->nchunks; ++i)
+        slz_put_be64(ctx, w->out, w->index[i]);
+
+    uint64_t footer_len = FOOTER_FIXED_LEN + INDEX_ENTRY_LEN * w->nchunks;
+    slz_put_be64(ctx, w->out, w->offset);
+    slz_put_be64(ctx, w->out, w->offset + footer_len + TRAILER_LEN);
+    slz_put_bytes(ctx, w->out, sizeof trailer_magic, trailer_magic);
+}
+
+
+/* Reading. */
+static void malformed(slz_ctx_t *ctx, slz_container_reader_t *r)
+{
+    ctx->state = SLZ_MALFORMED;
+    slz_raise(ctx, SLZ_SRC, r->src);
+}
+
+void slz_container_reader_open(
+    slz_ctx_t *ctx, slz_container_reader_t *r, slz_src_t *src)
+{
+    const char *end = src->end;
+    size_t len = src->end - src->pos;
+    r->src = src;
+
+    if (len < TRAILER_LEN ||
+        memcmp(end - sizeof trailer_magic, trailer_magic,
+               sizeof trailer_magic)) {
+        ctx->state = SLZ_BAD_HEADER;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+
+    uint64_t body_len = slz_load_be64(end - TRAILER_LEN);
+    uint64_t total_len = slz_load_be64(end - TRAILER_LEN + 8);
+    if (total_len > len || body_len > total_len ||
+        total_len - body_len < FOOTER_FIXED_LEN + TRAILER_LEN)
+        malformed(ctx, r);
+
+    r->start = end - total_len;
+    const char *footer = r->start + body_len;
+    r->nchunks = slz_load_be64(footer + 4);
+    r->nrecords = slz_load_be64(footer + 12);
+    if (slz_load_be32(footer) != 0 ||
+        r->nchunks > (total_len - body_len) / INDEX_ENTRY_LEN ||
+        FOOTER_FIXED_LEN + INDEX_ENTRY_LEN * r->nchunks + TRAILER_LEN
+        != total_len - body_len)
+        malformed(ctx, r);
+    r->index = footer + FOOTER_FIXED_LEN;
+    r->body_len = body_len;
+    r->next_record = UINT64_MAX;
+    r->next_pos = r->chunk_end = NULL;
+}
+
+uint64_t slz_container_num_records(slz_container_reader_t *r) {
+    return r->nrecords;
+}
+
+uint64_t slz_container_num_chunks(slz_container_reader_t *r) {
+    return r->nchunks;
+}
+
+bool slz_container_get_chunk(
+    slz_ctx_t *ctx, slz_container_reader_t *r, uint64_t i,
+    slz_src_t *chunk, uint64_t *first, uint32_t *count)
+{
+    if (i >= r->nchunks)
+        return false;
+    uint64_t offset = slz_load_be64(r->index + INDEX_ENTRY_LEN * i + 8);
+    if (offset > r->body_len || r->body_len - offset < CHUNK_HEADER_LEN)
+        malformed(ctx, r);
+    const char *p = r->start + offset;
+    uint32_t len = slz_load_be32(p);
+    if (r->body_len - offset - CHUNK_HEADER_LEN < len)
+        malformed(ctx, r);
+    if (first)
+        *first = slz_load_be64(r->index + INDEX_ENTRY_LEN * i);
+    if (count)
+        *count = slz_load_be32(p + 4);
+    slz_src_from_memory(ctx, chunk, p + CHUNK_HEADER_LEN, len);
+    chunk->little_endian = r->src->little_endian;
+    return true;
+}
+
+bool slz_container_chunk_next(
+    slz_ctx_t *ctx, slz_src_t *chunk, slz_src_t *record)
+{
+    if (chunk->pos == chunk->end)
+        return false;
+    uint32_t len = slz_get_be32(ctx, chunk);
+    const char *p = slz_get_bytes_view(ctx, chunk, len);
+    slz_src_from_memory(ctx, record, p, len);
+    record->little_endian = chunk->little_endian;
+    return true;
+}
+
+bool slz_container_get_record(
+    slz_ctx_t *ctx, slz_container_reader_t *r, uint64_t n, slz_src_t *record)
+{
+    if (n >= r->nrecords)
+        return false;
+
+    if (n != r->next_record) {
+        /* Find the last chunk starting at or before n. */
+        uint64_t lo = 0, hi = r->nchunks;
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (slz_load_be64(r->index + INDEX_ENTRY_LEN * mid) <= n)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        slz_src_t chunk;
+        uint64_t first = 0;
+        if (!slz_container_get_chunk(ctx, r, lo, &chunk, &first, NULL) ||
+            first > n)
+            malformed(ctx, r);
+        r->next_record = first;
+        r->next_pos = chunk.pos;
+        r->chunk_end = chunk.end;
+    }
+
+    /* Skip to record n within the chunk. Sequential reads skip nothing. */
+    for (;;) {
+        if (r->chunk_end - r->next_pos < 4)
+            malformed(ctx, r);
+        uint32_t len = slz_load_be32(r->next_pos);
+        if ((size_t) (r->chunk_end - r->next_pos - 4) < len)
+            malformed(ctx, r);
+        const char *data = r->next_pos + 4;
+        r->next_pos = data + len;
+        if (r->next_record++ == n) {
+            slz_src_from_memory(ctx, record, data, len);
+            record->little_endian = r->src->little_endian;
+            break;
+        }
+    }
+
+    /* The next record may be in the next chunk. */
+    if (r->next_pos == r->chunk_end)
+        r->next_record = UINT64_MAX;
+    return true;
+}
@@ -0,0 +1,396 @@
+/* fd transports: sources & sinks that do their own buffering over read(2),
+ * write(2) & friends.
+ *
+ * The buffers are FD_ALIGN-aligned so that these can do O_DIRECT I/O. For
+ * that, reads & writes must also be whole multiples of FD_ALIGN at aligned
+ * offsets: the source keeps the file offset aligned by always reading into the
+ * window at an aligned spot, and the sink only ever writes out whole blocks,
+ * but for the last one, on an explicit flush, which it writes without O_DIRECT
+ * and keeps, to write again once it's grown.
+ *
+ * Seekable fds are read & written with pread & pwrite at offsets we track, so
+ * a source leaves the fd's own offset alone.
+ */
+
+/* _GNU_SOURCE for O_DIRECT, which makes strerror_r the GNU one, hence
+ * slz_strerror_errno. */
+#define _GNU_SOURCE
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Buffers are at least this big, and aligned to FD_ALIGN, which is as much as
+ * O_DIRECT asks of offsets & lengths too. */
+#define FD_BUFSIZE (256 * 1024)
+#define FD_ALIGN 4096
+
+
+/* Vtable methods. */
+typedef struct {
+    int fd;
+    unsigned flags;
+    bool eof;
+    int saved_errno;
+    /* For seekable fds, the file offset of the next read, or of sink->buf;
+     * -1 otherwise. */
+    off_t offset;
+    /* Whether to use pread & pwrite at `offset' rather than read & write:
+     * always for seekable sources, and for sinks in O_DIRECT mode. */
+    bool positional;
+    /* Whether we set O_DIRECT, and the fd's status flags before that. */
+    bool direct;
+    int saved_fl;
+    /* Sources using O_DIRECT start at an aligned offset; this is how many
+     * bytes of the first read to skip. */
+    size_t skip;
+    const slz_allocator_t *allocator;
+} fd_t;
+
+static size_t round_up(size_t n) {
+    return (n + FD_ALIGN - 1) & ~(size_t) (FD_ALIGN - 1);
+}
+
+static bool fd_read(void *obj, char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* fd_fill is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static bool fd_write(void *obj, const char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* fd_flush is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t fd_strerror(void *objp, char *buf, size_t buflen)
+{
+    fd_t *obj = objp;
+    if (obj->eof)
+        return slz_strerror_msg(buf, buflen, "end-of-file reached");
+    return slz_strerror_errno(buf, buflen, obj->saved_errno);
+}
+
+/* Gives the fd back as we found it. */
+static void fd_release(fd_t *obj)
+{
+    if (obj->direct)
+        fcntl(obj->fd, F_SETFL, obj->saved_fl);
+    obj->direct = false;
+}
+
+static void fd_free(void *objp)
+{
+    fd_t *obj = objp;
+    fd_release(obj);
+    slz_allocator_free(obj->allocator, obj);
+}
+
+/* Allocates an aligned buffer of at least `size' bytes, or FD_BUFSIZE, and
+ * says how big it is in `*bufsize'. Returns NULL on OOM. */
+static char *alloc_buf(slz_ctx_t *ctx, size_t size, size_t *bufsize)
+{
+    size = round_up(size > FD_BUFSIZE ? size : FD_BUFSIZE);
+    char *buf = slz_try_malloc_aligned(ctx, size, FD_ALIGN);
+    if (buf)
+        *bufsize = size;
+    return buf;
+}
+
+static void fd_advise(fd_t *obj, off_t offset, size_t len)
+{
+    if ((obj->flags & SLZ_FD_DONTNEED) && obj->offset >= 0)
+        posix_fadvise(obj->fd, offset, (off_t) len, POSIX_FADV_DONTNEED);
+}
+
+static bool fd_fill(slz_ctx_t *ctx, void *objp, slz_src_t *src, size_t need)
+{
+    fd_t *obj = objp;
+    size_t have = src->end - src->pos;
+
+    /* Put what's left just before an aligned spot to read into, with room
+     * for the rest of `need' and the bytes to skip, rounded up to whole
+     * blocks. */
+    size_t dest = round_up(have);
+    size_t size = dest + round_up(need - have + obj->skip);
+    if (src->bufsize < size) {
+        char *buf = alloc_buf(ctx, size, &size);
+        if (!buf)
+            return false;
+        if (have)
+            memcpy(buf + dest - have, src->pos, have);
+        slz_free(ctx, src->buf);
+        src->buf = buf;
+        src->bufsize = size;
+    }
+    else if (have)
+        memmove(src->buf + dest - have, src->pos, have);
+    src->pos = src->buf + dest - have;
+    char *end = src->buf + dest;
+    src->end = end;
+
+    while ((size_t) (src->end - src->pos) < need) {
+        if (obj->eof)
+            return false;
+        size_t len = src->buf + src->bufsize - end;
+        if (obj->direct)
+            len &= ~(size_t) (FD_ALIGN - 1);
+        ssize_t n = obj->positional
+            ? pread(obj->fd, end, len, obj->offset)
+            : read(obj->fd, end, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            obj->saved_errno = errno;
+            return false;
+        }
+        if (!n || (obj->direct && (size_t) n % FD_ALIGN)) {
+            /* A short O_DIRECT read means the end of the file, and another
+             * read from the unaligned offset would fail. */
+            obj->eof = true;
+            if (!n)
+                return false;
+        }
+        fd_advise(obj, obj->offset, (size_t) n);
+        if (obj->offset >= 0)
+            obj->offset += n;
+        end += n;
+
+        size_t skip = obj->skip < (size_t) n ? obj->skip : (size_t) n;
+        src->pos += skip;
+        obj->skip -= skip;
+        src->end = end;
+    }
+    return true;
+}
+
+static bool fd_seek(
+    slz_ctx_t *ctx, void *objp, slz_src_t *src, uint64_t offset)
+{
+    fd_t *obj = objp;
+    obj->eof = false;
+
+    if (obj->offset >= 0) {
+        /* The next read, at obj->offset, will give src->offset once the
+         * first `skip' bytes are dropped. */
+        off_t target = obj->offset + (off_t) obj->skip
+            - (off_t) src->offset + (off_t) offset;
+        if (target < 0) {
+            obj->saved_errno = EINVAL;
+            return false;
+        }
+        obj->offset = target;
+        obj->skip = 0;
+        if (obj->direct) {
+            obj->skip = (size_t) target & (FD_ALIGN - 1);
+            obj->offset -= (off_t) obj->skip;
+        }
+        src->pos = src->end = src->buf;
+        src->offset = offset;
+        return true;
+    }
+
+    /* A pipe: read our way there. */
+    if (offset < src->offset) {
+        obj->saved_errno = ESPIPE;
+        return false;
+    }
+    while (src->offset < offset) {
+        src->pos = src->end;
+        if (!fd_fill(ctx, obj, src, 1))
+            return false;
+        src->offset += src->end - src->pos;
+    }
+    src->pos = src->end - (src->offset - offset);
+    return true;
+}
+
+/* Writes the `len' bytes at `buf', coping with short writes. */
+static bool fd_write_all(fd_t *obj, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = obj->positional
+            ? pwrite(obj->fd, buf, len, obj->offset)
+            : write(obj->fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            obj->saved_errno = errno;
+            return false;
+        }
+        fd_advise(obj, obj->offset, (size_t) n);
+        if (obj->offset >= 0)
+            obj->offset += n;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+static bool fd_flush(slz_ctx_t *ctx, void *objp, slz_sink_t *sink, size_t need)
+{
+    fd_t *obj = objp;
+    size_t pending = sink->pos - sink->buf;
+
+    if (!obj->direct) {
+        if (!fd_write_all(obj, sink->buf, pending))
+            return false;
+        sink->pos = sink->buf;
+    }
+    else {
+        /* Whole blocks go out with O_DIRECT; the rest stays in the buffer,
+         * to go out with them once there are more. */
+        size_t whole = pending & ~(size_t) (FD_ALIGN - 1);
+        if (!fd_write_all(obj, sink->buf, whole))
+            return false;
+        size_t tail = pending - whole;
+        if (whole && tail)
+            memmove(sink->buf, sink->buf + whole, tail);
+        sink->pos = sink->buf + tail;
+
+        if (!need) {
+            /* Write the tail without O_DIRECT, and leave the fd's offset
+             * after it, as if we'd written it for good. */
+            off_t offset = obj->offset;
+            fcntl(obj->fd, F_SETFL, obj->saved_fl);
+            bool ok = fd_write_all(obj, sink->buf, tail);
+            fcntl(obj->fd, F_SETFL, obj->saved_fl | O_DIRECT);
+            if (!ok)
+                return false;
+            lseek(obj->fd, obj->offset, SEEK_SET);
+            obj->offset = offset;
+        }
+    }
+
+    size_t used = sink->pos - sink->buf, size;
+    if ((size_t) (sink->end - sink->pos) < need) {
+        char *buf = alloc_buf(ctx, used + need, &size);
+        if (!buf)
+            return false;
+        if (used)
+            memcpy(buf, sink->buf, used);
+        slz_free(ctx, sink->buf);
+        sink->buf = buf;
+        sink->pos = buf + used;
+        sink->end = buf + size;
+    }
+    return true;
+}
+
+static slz_src_funcs_t fd_src_funcs = {
+    .read = fd_read,
+    .strerror = fd_strerror,
+    .free = fd_free,
+    .fill = fd_fill,
+    .seek = fd_seek
+};
+
+static slz_sink_funcs_t fd_sink_funcs = {
+    .write = fd_write,
+    .strerror = fd_strerror,
+    .free = fd_free,
+    .flush = fd_flush
+};
+
+
+/* Initializers. */
+
+/* Sets up `obj' (allocated if NULL) for `fd'. */
+static fd_t *fd_init(slz_ctx_t *ctx, fd_t *obj, int fd, unsigned flags)
+{
+    if (!obj) {
+        obj = slz_malloc(ctx, sizeof(fd_t));
+        obj->allocator = ctx->allocator;
+    }
+    obj->fd = fd;
+    obj->flags = flags;
+    obj->eof = false;
+    obj->saved_errno = 0;
+    obj->offset = lseek(fd, 0, SEEK_CUR);
+    obj->positional = obj->direct = false;
+    obj->skip = 0;
+
+    /* These are only hints; don't care if they fail. */
+    if (flags & SLZ_FD_SEQUENTIAL)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (flags & SLZ_FD_WILLNEED)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    /* O_DIRECT needs pread & pwrite, and isn't supported everywhere. If we
+     * can't have it, we do without. */
+    if ((flags & SLZ_FD_DIRECT) && obj->offset >= 0 &&
+        (obj->saved_fl = fcntl(fd, F_GETFL)) >= 0 &&
+        !fcntl(fd, F_SETFL, obj->saved_fl | O_DIRECT))
+        obj->direct = true;
+    return obj;
+}
+
+static fd_t *fd_src_init(slz_ctx_t *ctx, fd_t *obj, int fd, unsigned flags)
+{
+    obj = fd_init(ctx, obj, fd, flags);
+    obj->positional = obj->offset >= 0;
+    if (obj->direct) {
+        obj->skip = (size_t) obj->offset & (FD_ALIGN - 1);
+        obj->offset -= (off_t) obj->skip;
+    }
+    return obj;
+}
+
+static fd_t *fd_sink_init(slz_ctx_t *ctx, fd_t *obj, int fd, unsigned flags)
+{
+    obj = fd_init(ctx, obj, fd, flags);
+    if (obj->direct && (obj->offset & (FD_ALIGN - 1))) {
+        /* We'd have to read back the start of the block; not worth it. */
+        fcntl(fd, F_SETFL, obj->saved_fl);
+        obj->direct = false;
+    }
+    obj->positional = obj->direct;
+    return obj;
+}
+
+/* Resetting keeps the buffer, unless it's one O_DIRECT can't use. */
+static bool misaligned(fd_t *obj, const char *buf) {
+    return obj->direct && ((uintptr_t) buf & (FD_ALIGN - 1));
+}
+
+void slz_src_from_fd(slz_ctx_t *ctx, slz_src_t *src, int fd, unsigned flags)
+{
+    slz_src_init(ctx, src, &fd_src_funcs, fd_src_init(ctx, NULL, fd, flags));
+}
+
+void slz_sink_from_fd(slz_ctx_t *ctx, slz_sink_t *sink, int fd, unsigned flags)
+{
+    slz_sink_init(
+        ctx, sink, &fd_sink_funcs, fd_sink_init(ctx, NULL, fd, flags));
+}
+
+void slz_src_reset_fd(slz_ctx_t *ctx, slz_src_t *src, int fd, unsigned flags)
+{
+    fd_t *obj = NULL;
+    if (src->funcs == &fd_src_funcs)
+        fd_release(obj = src->obj);
+    slz_src_reset(ctx, src, &fd_src_funcs, fd_src_init(ctx, obj, fd, flags));
+    if (misaligned(src->obj, src->buf)) {
+        slz_free(ctx, src->buf);
+        src->buf = NULL;
+        src->bufsize = 0;
+    }
+}
+
+void slz_sink_reset_fd(
+    slz_ctx_t *ctx, slz_sink_t *sink, int fd, unsigned flags)
+{
+    fd_t *obj = NULL;
+    if (sink->funcs == &fd_sink_funcs)
+        fd_release(obj = sink->obj);
+    slz_sink_reset(
+        ctx, sink, &fd_sink_funcs, fd_sink_init(ctx, obj, fd, flags));
+    if (misaligned(sink->obj, sink->buf)) {
+        slz_free(ctx, sink->buf);
+        sink->buf = sink->pos = sink->end = NULL;
+    }
+}
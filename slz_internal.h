@@ -0,0 +1,142 @@
+#ifndef _SLZ_INTERNAL_H_
+#define _SLZ_INTERNAL_H_
+
+/* Internals shared between libslz's source files. Not installed. */
+
+#include "slz.h"
+
+#include <stdlib.h>
+
+#define ARRAY_LEN(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define IMPOSSIBLE do { assert(0); abort(); } while (0)
+
+/* Precondition: !slz_ok(ctx). Jumps to the innermost slz_catch, or failing
+ * that calls the toplevel error handler and aborts. */
+void slz_reraise(slz_ctx_t *ctx);
+/* As slz_reraise, but first records `origin' as the source of the error. */
+void slz_raise(slz_ctx_t *ctx, slz_origin_t origin_type, void *origin);
+
+/* Big-endian loads & stores, for memory that's already been bounds-checked. */
+static inline uint32_t slz_load_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char*) p;
+    return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16) |
+        ((uint32_t) u[2] << 8) | (uint32_t) u[3];
+}
+
+static inline uint64_t slz_load_be64(const char *p) {
+    return ((uint64_t) slz_load_be32(p) << 32) | slz_load_be32(p + 4);
+}
+
+static inline void slz_store_be32(char *p, uint32_t val)
+{
+    unsigned char *u = (unsigned char*) p;
+    u[0] = (unsigned char) (val >> 24);
+    u[1] = (unsigned char) (val >> 16);
+    u[2] = (unsigned char) (val >> 8);
+    u[3] = (unsigned char) val;
+}
+
+static inline void slz_store_be64(char *p, uint64_t val)
+{
+    slz_store_be32(p, (uint32_t) (val >> 32));
+    slz_store_be32(p + 4, (uint32_t) val);
+}
+
+/* libslz's own framing (block headers, container chunks & indexes) is
+ * big-endian whatever order the payload is in (see SLZ_HEADER_LITTLE_ENDIAN),
+ * so it goes through these rather than slz_put_uint32 & co. */
+static inline void slz_put_be32(slz_ctx_t *ctx, slz_sink_t *sink, uint32_t val)
+{
+    slz_store_be32(slz_sink_reserve(ctx, sink, 4), val);
+    sink->pos += 4;
+}
+
+static inline void slz_put_be64(slz_ctx_t *ctx, slz_sink_t *sink, uint64_t val)
+{
+    slz_store_be64(slz_sink_reserve(ctx, sink, 8), val);
+    sink->pos += 8;
+}
+
+static inline void slz_try_put_be32(
+    slz_ctx_t *ctx, slz_sink_t *sink, uint32_t val)
+{
+    if (slz_sink_try_reserve(ctx, sink, 4)) {
+        slz_store_be32(sink->pos, val);
+        sink->pos += 4;
+    }
+}
+
+static inline uint32_t slz_get_be32(slz_ctx_t *ctx, slz_src_t *src)
+{
+    uint32_t val = slz_load_be32(slz_src_peek(ctx, src, 4));
+    src->pos += 4;
+    return val;
+}
+
+static inline uint32_t slz_try_get_be32(slz_ctx_t *ctx, slz_src_t *src)
+{
+    if (!slz_src_try_reserve(ctx, src, 4))
+        return 0;
+    uint32_t val = slz_load_be32(src->pos);
+    src->pos += 4;
+    return val;
+}
+
+/* Raises SLZ_OOM on failure. */
+void *slz_malloc(slz_ctx_t *ctx, size_t sz);
+/* Like slz_malloc, but returns NULL (with ctx->state set) instead of
+ * raising. */
+void *slz_try_malloc(slz_ctx_t *ctx, size_t sz);
+/* Likewise, aligned to `align', a power of two no more than 4096. */
+void *slz_try_malloc_aligned(slz_ctx_t *ctx, size_t sz, size_t align);
+/* slz_free, for objects freed where there's no context at hand (vtable free
+ * methods), which keep the allocator they came from. */
+void slz_allocator_free(const slz_allocator_t *allocator, void *p);
+
+/* For the sticky-error API: mark `sink'/`src' as failed, so that the try_
+ * functions leave them alone until their errors are cleared. The caller must
+ * have set ctx->state & origin. Return false, for convenience. */
+bool slz_sink_poison(slz_ctx_t *ctx, slz_sink_t *sink);
+bool slz_src_poison(slz_ctx_t *ctx, slz_src_t *src);
+
+/* For sinks & sources that manage their own buffers (see the flush & fill
+ * hooks), and for libslz's own.
+ *
+ * slz_sink_try_alloc: once the sink's buffer has been emptied, makes sure it
+ * has room for `need' bytes, replacing it with one of at least `min_size'
+ * bytes if not.
+ *
+ * slz_src_try_compact: moves the bytes left in the source's window to the
+ * front of src->buf, making sure there's room for `room' more after them, and
+ * growing src->buf to at least `min_size' bytes if there isn't.
+ *
+ * Both return false on OOM, without setting the origin. */
+bool slz_sink_try_alloc(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t need, size_t min_size);
+bool slz_src_try_compact(
+    slz_ctx_t *ctx, slz_src_t *src, size_t room, size_t min_size);
+
+/* Push sources (see slz_push.c): notes the string table just attached to
+ * `src', if it's a push source, as it is now, for slz_src_push_rewind to go
+ * back to. */
+void slz_src_push_intern_changed(slz_src_t *src);
+
+/* For implementing the strerror vtable method with a fixed message. */
+size_t slz_strerror_msg(char *buf, size_t buflen, const char *msg);
+/* Likewise with strerror_r's message for `errnum', for files that can't have
+ * the XSI strerror_r. */
+size_t slz_strerror_errno(char *buf, size_t buflen, int errnum);
+
+/* Containers (see slz_container.c): the uint32 payload length & uint32 record
+ * count that start each chunk. */
+#define SLZ_CHUNK_HEADER_LEN 8
+
+/* Adds the index entry for a chunk with `len' bytes of payload, starting with
+ * record `first', which the caller has written to w->out. Returns false on
+ * OOM. */
+bool slz_container_try_add_chunk(slz_ctx_t *ctx, slz_container_writer_t *w,
+                                 uint64_t first, size_t len);
+
+#endif
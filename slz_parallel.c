@@ -0,0 +1,424 @@
+/* Encoding & decoding container chunks on a pool of threads.
+ *
+ * Each worker has its own slz_ctx_t, and each job its own memory buffer: the
+ * writer hands out batches of records to encode into chunks, and writes the
+ * results to the container in order; the reader splits the stream into chunks
+ * by their length prefixes, and hands those out to decode. Only the calling
+ * thread touches the caller's ctx, src and sink, and it does so with the
+ * slz_try_* functions, so that an error can't jump out from under the pool.
+ *
+ * Jobs live in a ring of slots, twice as many as there are workers, which
+ * bounds how far ahead of the calling thread the workers can get.
+ */
+
+/* _POSIX_C_SOURCE for pthreads; _DEFAULT_SOURCE for _SC_NPROCESSORS_ONLN. */
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define MAX_BATCH 4096
+
+
+/* The pool. */
+typedef struct pool pool_t;
+
+typedef struct {
+    bool done;
+    slz_state_t state;
+    /* Encoding: records [lo, hi) are encoded into `out' as chunks, whose
+     * first records (relative to lo) are in `firsts'. */
+    size_t lo, hi;
+    slz_sink_t out;
+    uint64_t *firsts;
+    size_t nfirsts, firsts_cap;
+    /* Decoding: a chunk, of `count' records starting at record `first'. */
+    char *buf;
+    size_t len, cap;
+    uint32_t count;
+    uint64_t first;
+} job_t;
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    /* Jobs [taken, queued) are waiting for a worker. Job n is in slot
+     * n % nslots. */
+    size_t queued, taken;
+    bool quit;
+    job_t *jobs;
+    size_t nslots;
+    pthread_t *threads;
+    unsigned nthreads;
+
+    void (*run)(slz_ctx_t *ctx, pool_t *pool, job_t *job);
+    void (*encode)(slz_ctx_t *ctx, slz_sink_t *sink, size_t i, void *data);
+    void (*decode)(slz_ctx_t *ctx, slz_src_t *src, uint64_t i, void *data);
+    void *userdata;
+    size_t chunk_size;
+    bool little_endian;         /* the records' byte order */
+    /* The caller's, which the workers' contexts share. */
+    const slz_allocator_t *allocator;
+};
+
+static void uncaught(slz_ctx_t *ctx, void *data)
+{
+    /* Can't happen: jobs run under slz_catch. */
+    (void) ctx; (void) data;
+}
+
+static void run_job(slz_ctx_t *ctx, pool_t *p, job_t *job)
+{
+    if (slz_catch(ctx)) {
+        job->state = ctx->state;
+        slz_clear_error(ctx);
+        return;
+    }
+    p->run(ctx, p, job);
+    /* A callback using the slz_try_* functions may leave a sticky error. */
+    job->state = ctx->state;
+    slz_clear_error(ctx);
+    slz_end_catch(ctx);
+}
+
+static void *worker(void *arg)
+{
+    pool_t *p = arg;
+    slz_ctx_t ctx;
+    slz_init(&ctx, uncaught, NULL);
+    slz_set_allocator(&ctx, p->allocator);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->quit && p->taken == p->queued)
+            pthread_cond_wait(&p->work, &p->lock);
+        if (p->taken == p->queued)
+            break;
+        job_t *job = &p->jobs[p->taken++ % p->nslots];
+        pthread_mutex_unlock(&p->lock);
+
+        run_job(&ctx, p, job);
+
+        pthread_mutex_lock(&p->lock);
+        job->done = true;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static unsigned default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : (unsigned) n;
+}
+
+/* Raises on failure, before any threads are running. */
+static pool_t *pool_start(slz_ctx_t *ctx, unsigned nthreads,
+                          void (*run)(slz_ctx_t*, pool_t*, job_t*))
+{
+    if (!nthreads)
+        nthreads = default_threads();
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    pool_t *p = slz_malloc(ctx, sizeof *p);
+    p->nslots = 2 * (size_t) nthreads;
+    if (!(p->jobs = slz_try_malloc(ctx, p->nslots * sizeof *p->jobs)) ||
+        !(p->threads = slz_try_malloc(ctx, nthreads * sizeof *p->threads))) {
+        slz_free(ctx, p->jobs);
+        slz_free(ctx, p);
+        slz_reraise(ctx);
+    }
+    memset(p->jobs, 0, p->nslots * sizeof *p->jobs);
+    for (size_t i = 0; i < p->nslots; ++i)
+        slz_sink_to_memory(ctx, &p->jobs[i].out);
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->queued = p->taken = 0;
+    p->quit = false;
+    p->run = run;
+    p->allocator = ctx->allocator;
+
+    /* Make do with however many threads we can get. */
+    for (p->nthreads = 0; p->nthreads < nthreads; ++p->nthreads)
+        if (pthread_create(&p->threads[p->nthreads], NULL, worker, p))
+            break;
+    return p;
+}
+
+/* Call with the lock held. Returns the slot for the next job, or NULL if
+ * they're all in use. */
+static job_t *pool_next_slot(pool_t *p, size_t written)
+{
+    if (p->queued - written == p->nslots)
+        return NULL;
+    job_t *job = &p->jobs[p->queued % p->nslots];
+    job->done = false;
+    return job;
+}
+
+/* Call with the lock held, after setting up the job pool_next_slot gave. */
+static void pool_queue(pool_t *p)
+{
+    p->queued++;
+    pthread_cond_signal(&p->work);
+}
+
+/* Call with the lock held. */
+static job_t *pool_wait(pool_t *p, size_t n)
+{
+    job_t *job = &p->jobs[n % p->nslots];
+    while (!job->done)
+        pthread_cond_wait(&p->done, &p->lock);
+    return job;
+}
+
+/* Call with the lock held; releases it. Drops any jobs no worker has taken
+ * yet, waits for the rest, and frees everything. */
+static void pool_stop(slz_ctx_t *ctx, pool_t *p)
+{
+    p->queued = p->taken;
+    p->quit = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    for (unsigned i = 0; i < p->nthreads; ++i)
+        pthread_join(p->threads[i], NULL);
+
+    for (size_t i = 0; i < p->nslots; ++i) {
+        slz_sink_destroy(ctx, &p->jobs[i].out);
+        slz_free(ctx, p->jobs[i].firsts);
+        slz_free(ctx, p->jobs[i].buf);
+    }
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    slz_free(ctx, p->threads);
+    slz_free(ctx, p->jobs);
+    slz_free(ctx, p);
+}
+
+
+/* Encoding. */
+static void add_first(slz_ctx_t *ctx, job_t *job, uint64_t first)
+{
+    if (job->nfirsts == job->firsts_cap) {
+        size_t cap = job->firsts_cap ? 2 * job->firsts_cap : 16;
+        uint64_t *firsts = slz_malloc(ctx, cap * sizeof *firsts);
+        if (job->nfirsts)
+            memcpy(firsts, job->firsts, job->nfirsts * sizeof *firsts);
+        slz_free(ctx, job->firsts);
+        job->firsts = firsts;
+        job->firsts_cap = cap;
+    }
+    job->firsts[job->nfirsts++] = first;
+}
+
+static void encode_job(slz_ctx_t *ctx, pool_t *p, job_t *job)
+{
+    slz_sink_t *out = &job->out;
+    size_t chunk_start = 0, chunk_first = job->lo;
+    out->pos = out->buf;
+    out->little_endian = p->little_endian;
+    job->nfirsts = 0;
+
+    for (size_t i = job->lo; i < job->hi; ++i) {
+        if (i == chunk_first) {
+            chunk_start = out->pos - out->buf;
+            slz_put_be64(ctx, out, 0); /* header; filled in below */
+        }
+
+        size_t record_start = out->pos - out->buf;
+        slz_put_be32(ctx, out, 0);
+        p->encode(ctx, out, i, p->userdata);
+        size_t len = out->pos - out->buf - record_start - 4;
+        assert (len <= UINT32_MAX);
+        slz_store_be32(out->buf + record_start, (uint32_t) len);
+
+        size_t chunk_len = out->pos - out->buf - chunk_start
+            - SLZ_CHUNK_HEADER_LEN;
+        if (chunk_len >= p->chunk_size || i + 1 == job->hi) {
+            assert (chunk_len <= UINT32_MAX);
+            slz_store_be32(out->buf + chunk_start, (uint32_t) chunk_len);
+            slz_store_be32(out->buf + chunk_start + 4,
+                           (uint32_t) (i + 1 - chunk_first));
+            add_first(ctx, job, chunk_first - job->lo);
+            chunk_first = i + 1;
+        }
+    }
+}
+
+/* Writes out an encoded job. Doesn't raise. */
+static bool write_job(slz_ctx_t *ctx, slz_container_writer_t *w, job_t *job)
+{
+    const char *buf = job->out.buf, *end = job->out.pos;
+    slz_try_put_bytes(ctx, w->out, end - buf, buf);
+    if (!slz_ok(ctx))
+        return false;
+
+    for (size_t i = 0; i < job->nfirsts; ++i) {
+        size_t len = slz_load_be32(buf);
+        if (!slz_container_try_add_chunk(
+                ctx, w, w->nrecords + job->lo + job->firsts[i], len))
+            return false;
+        buf += SLZ_CHUNK_HEADER_LEN + len;
+    }
+    assert (buf == end);
+    return true;
+}
+
+void slz_container_put_parallel(
+    slz_ctx_t *ctx, slz_container_writer_t *w, size_t nrecords,
+    void (*encode)(slz_ctx_t *ctx, slz_sink_t *sink, size_t i, void *data),
+    void *userdata,
+    unsigned nthreads, size_t batch)
+{
+    slz_container_end_chunk(ctx, w);
+    if (!nrecords)
+        return;
+
+    pool_t *p = pool_start(ctx, nthreads, encode_job);
+    p->encode = encode;
+    p->userdata = userdata;
+    p->chunk_size = w->chunk_size;
+    p->little_endian = w->out->little_endian;
+    if (!batch) {
+        batch = nrecords / (4 * (size_t) p->nthreads);
+        batch = batch < 1 ? 1 : batch > MAX_BATCH ? MAX_BATCH : batch;
+    }
+
+    size_t njobs = nrecords / batch + (nrecords % batch != 0);
+    size_t written = 0;
+    job_t *job;
+
+    pthread_mutex_lock(&p->lock);
+    while (written < njobs && p->nthreads) {
+        while (p->queued < njobs && (job = pool_next_slot(p, written))) {
+            job->lo = p->queued * batch;
+            job->hi = job->lo + batch < nrecords ? job->lo + batch : nrecords;
+            pool_queue(p);
+        }
+
+        job = pool_wait(p, written);
+        pthread_mutex_unlock(&p->lock);
+        if (job->state != SLZ_OK)
+            ctx->state = job->state;
+        bool ok = slz_ok(ctx) && write_job(ctx, w, job);
+        pthread_mutex_lock(&p->lock);
+        if (!ok)
+            break;
+        written++;
+    }
+    if (!p->nthreads)
+        ctx->state = SLZ_OOM;   /* couldn't start a single thread */
+    pool_stop(ctx, p);
+
+    if (!slz_ok(ctx)) {
+        slz_sink_clear_error(w->out);
+        slz_raise(ctx, SLZ_SINK, w->out);
+    }
+    w->nrecords += nrecords;
+    w->chunk_first = w->nrecords;
+}
+
+
+/* Decoding. */
+static void decode_job(slz_ctx_t *ctx, pool_t *p, job_t *job)
+{
+    slz_src_t chunk, record;
+    slz_src_from_memory(ctx, &chunk, job->buf, job->len);
+    chunk.little_endian = p->little_endian;
+    uint64_t i = 0;
+    for (; i < job->count && slz_container_chunk_next(ctx, &chunk, &record);
+         ++i)
+        p->decode(ctx, &record, job->first + i, p->userdata);
+    if (i != job->count || chunk.pos != chunk.end || !job->count) {
+        ctx->state = SLZ_MALFORMED;
+        slz_raise(ctx, SLZ_SRC, &chunk);
+    }
+}
+
+/* Reads the next chunk into `job'. Returns false at the end of the chunks, or
+ * on error. Doesn't raise. */
+static bool read_chunk(slz_ctx_t *ctx, slz_src_t *src, job_t *job)
+{
+    job->len = slz_try_get_be32(ctx, src);
+    if (!job->len)
+        return false;
+    job->count = slz_try_get_be32(ctx, src);
+    if (job->cap < job->len) {
+        slz_free(ctx, job->buf);
+        job->cap = 0;
+        if (!(job->buf = slz_try_malloc(ctx, job->len)))
+            return false;
+        job->cap = job->len;
+    }
+    slz_try_get_bytes(ctx, src, job->len, job->buf);
+    return slz_ok(ctx);
+}
+
+/* A record that runs out is malformed, rather than an IO error on a memory
+ * source the caller has never heard of. */
+static slz_state_t job_state(job_t *job) {
+    return job->state == SLZ_IO_ERROR ? SLZ_MALFORMED : job->state;
+}
+
+uint64_t slz_container_get_parallel(
+    slz_ctx_t *ctx, slz_src_t *src,
+    void (*decode)(slz_ctx_t *ctx, slz_src_t *src, uint64_t i, void *data),
+    void *userdata, unsigned nthreads)
+{
+    pool_t *p = pool_start(ctx, nthreads, decode_job);
+    p->decode = decode;
+    p->userdata = userdata;
+    p->little_endian = src->little_endian;
+
+    uint64_t nrecords = 0;
+    size_t written = 0;         /* ie. jobs whose results have been checked */
+    bool more = p->nthreads;
+    job_t *job;
+
+    pthread_mutex_lock(&p->lock);
+    while (more || written < p->queued) {
+        if (more && (job = pool_next_slot(p, written))) {
+            /* Nobody's looking at the slot; no need to hold the lock. */
+            pthread_mutex_unlock(&p->lock);
+            more = read_chunk(ctx, src, job);
+            pthread_mutex_lock(&p->lock);
+            if (more) {
+                job->first = nrecords;
+                nrecords += job->count;
+                pool_queue(p);
+            }
+            else if (!slz_ok(ctx))
+                break;
+            continue;
+        }
+
+        job = pool_wait(p, written);
+        if (job->state != SLZ_OK) {
+            ctx->state = job_state(job);
+            break;
+        }
+        written++;
+    }
+    if (!p->nthreads)
+        ctx->state = SLZ_OOM;   /* couldn't start a single thread */
+    pool_stop(ctx, p);
+
+    if (!slz_ok(ctx)) {
+        slz_src_clear_error(src);
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+    return nrecords;
+}
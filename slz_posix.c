@@ -0,0 +1,356 @@
+/* Transports that need more than stdio. */
+
+/* _POSIX_C_SOURCE for XSI-compliant strerror_r, as in slz.c; _DEFAULT_SOURCE
+ * for MAP_ANONYMOUS & madvise. */
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Huge pages are this big on the platforms we care about. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+/* Gather sinks copy anything smaller than this rather than reference it. */
+#define GATHER_MIN_REF 1024
+#define GATHER_BUFSIZE (64 * 1024)
+
+
+/* mmap vtables and methods. */
+typedef struct {
+    void *map;
+    size_t len;
+    bool eof;
+    int saved_errno;
+    const slz_allocator_t *allocator;
+} mmap_t;
+
+static bool mmap_read(void *obj, char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* mmap_fill is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t mmap_strerror(void *objp, char *buf, size_t buflen)
+{
+    mmap_t *obj = objp;
+    if (obj->eof)
+        return slz_strerror_msg(buf, buflen, "end-of-file reached");
+    return strerror_r(obj->saved_errno, buf, buflen) ? SIZE_MAX : 0;
+}
+
+static void mmap_free(void *objp)
+{
+    mmap_t *obj = objp;
+    if (obj->map)
+        munmap(obj->map, obj->len);
+    slz_allocator_free(obj->allocator, obj);
+}
+
+static bool mmap_fill(slz_ctx_t *ctx, void *objp, slz_src_t *src, size_t need)
+{
+    /* The whole file is in the window already, so we've hit the end. */
+    mmap_t *obj = objp;
+    obj->eof = true;
+    (void) ctx; (void) src; (void) need;
+    return false;
+}
+
+static bool mmap_seek(
+    slz_ctx_t *ctx, void *objp, slz_src_t *src, uint64_t offset)
+{
+    /* Likewise, the window is the whole file. */
+    mmap_t *obj = objp;
+    if (offset > src->offset) {
+        obj->eof = true;
+        src->pos = src->end;
+        return false;
+    }
+    src->pos = src->end - (src->offset - offset);
+    (void) ctx;
+    return true;
+}
+
+static slz_src_funcs_t mmap_src_funcs = {
+    .read = mmap_read,
+    .strerror = mmap_strerror,
+    .free = mmap_free,
+    .fill = mmap_fill,
+    .seek = mmap_seek
+};
+
+/* Maps `len' bytes of `fd' at a huge-page-aligned address, so that the kernel
+ * can back it with huge pages if it's willing to. */
+static void *mmap_aligned(int fd, size_t len)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t maplen = (len + page - 1) / page * page;
+    if (maplen + HUGE_PAGE_SIZE < maplen)
+        return MAP_FAILED;
+
+    /* Reserve enough address space to find an aligned spot in, map the file
+     * there, and give back the rest. */
+    char *reserved = mmap(NULL, maplen + HUGE_PAGE_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED)
+        return MAP_FAILED;
+    char *aligned = (char*) (((uintptr_t) reserved + HUGE_PAGE_SIZE - 1)
+                             & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    char *map = mmap(aligned, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+        int saved_errno = errno;
+        munmap(reserved, maplen + HUGE_PAGE_SIZE);
+        errno = saved_errno;
+        return MAP_FAILED;
+    }
+    if (aligned > reserved)
+        munmap(reserved, aligned - reserved);
+    munmap(aligned + maplen, reserved + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(map, len, MADV_HUGEPAGE);
+#endif
+    return map;
+}
+
+/* On failure, returns false with errno set. */
+static bool mmap_fd(mmap_t *obj, int fd, unsigned flags)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return false;
+    if ((uintmax_t) st.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+    obj->len = (size_t) st.st_size;
+    if (!obj->len)
+        return true;            /* can't map nothing; nothing to map anyway */
+
+    void *map = (flags & SLZ_MMAP_HUGEPAGE)
+        ? mmap_aligned(fd, obj->len)
+        : mmap(NULL, obj->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    obj->map = map;
+
+    /* These are only hints; don't care if they fail. */
+    if (flags & SLZ_MMAP_SEQUENTIAL)
+        madvise(map, obj->len, MADV_SEQUENTIAL);
+    if (flags & SLZ_MMAP_WILLNEED)
+        madvise(map, obj->len, MADV_WILLNEED);
+    return true;
+}
+
+/* mmap initializers. */
+static void mmap_init(
+    slz_ctx_t *ctx, slz_src_t *src, const char *path, int fd, unsigned flags)
+{
+    mmap_t *obj = slz_malloc(ctx, sizeof(mmap_t));
+    obj->map = NULL;
+    obj->len = 0;
+    obj->eof = false;
+    obj->saved_errno = 0;
+    obj->allocator = ctx->allocator;
+    slz_src_init(ctx, src, &mmap_src_funcs, (void*) obj);
+
+    bool ok;
+    if (path) {
+        fd = open(path, O_RDONLY);
+        ok = fd >= 0 && mmap_fd(obj, fd, flags);
+        /* The mapping outlives the descriptor, so we're done with it. */
+        int saved_errno = errno;
+        if (fd >= 0)
+            close(fd);
+        errno = saved_errno;
+    }
+    else
+        ok = mmap_fd(obj, fd, flags);
+
+    if (!ok) {
+        /* The caller gets to slz_perror this, so leave obj alive; they
+         * destroy src as usual. */
+        obj->saved_errno = errno;
+        ctx->state = SLZ_IO_ERROR;
+        slz_raise(ctx, SLZ_SRC, src);
+    }
+
+    src->pos = obj->map;
+    src->end = (char*) obj->map + obj->len;
+    src->offset = obj->len;
+}
+
+void slz_src_from_fd_mmap(
+    slz_ctx_t *ctx, slz_src_t *src, int fd, unsigned flags)
+{
+    mmap_init(ctx, src, NULL, fd, flags);
+}
+
+void slz_src_from_path(
+    slz_ctx_t *ctx, slz_src_t *src, const char *path, unsigned flags)
+{
+    mmap_init(ctx, src, path, -1, flags);
+}
+
+
+
+/* Gather sinks.
+ *
+ * What's written to a gather sink is a list of iovecs, to be handed to writev
+ * on flush: stretches of the sink's buffer, where small values are copied as
+ * usual, interleaved with references to caller memory from
+ * slz_put_bytes_ref. `mark' is where the stretch of the buffer not yet in the
+ * list starts. The buffer is never reallocated while the list refers to it.
+ */
+typedef struct {
+    int fd;
+    int saved_errno;
+    struct iovec *iov;
+    size_t niov, iov_cap;
+    char *mark;
+    const slz_allocator_t *allocator;
+} gather_t;
+
+static bool gather_write(void *obj, const char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* gather_flush is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t gather_strerror(void *objp, char *buf, size_t buflen)
+{
+    gather_t *obj = objp;
+    return strerror_r(obj->saved_errno, buf, buflen) ? SIZE_MAX : 0;
+}
+
+static void gather_free(void *objp)
+{
+    gather_t *obj = objp;
+    slz_allocator_free(obj->allocator, obj->iov);
+    slz_allocator_free(obj->allocator, obj);
+}
+
+static bool add_iov(slz_ctx_t *ctx, gather_t *obj, const void *data, size_t len)
+{
+    if (obj->niov == obj->iov_cap) {
+        size_t cap = obj->iov_cap ? 2 * obj->iov_cap : 64;
+        struct iovec *iov = slz_try_malloc(ctx, cap * sizeof *iov);
+        if (!iov)
+            return false;
+        if (obj->niov)
+            memcpy(iov, obj->iov, obj->niov * sizeof *iov);
+        slz_free(ctx, obj->iov);
+        obj->iov = iov;
+        obj->iov_cap = cap;
+    }
+    obj->iov[obj->niov].iov_base = (void*) data;
+    obj->iov[obj->niov].iov_len = len;
+    obj->niov++;
+    return true;
+}
+
+/* Closes off the stretch of the buffer since the last reference. */
+static bool add_buffered(slz_ctx_t *ctx, gather_t *obj, slz_sink_t *sink)
+{
+    if (sink->pos == obj->mark)
+        return true;
+    if (!add_iov(ctx, obj, obj->mark, sink->pos - obj->mark))
+        return false;
+    obj->mark = sink->pos;
+    return true;
+}
+
+/* Writes out the whole list, coping with short writes. */
+static bool writev_all(int fd, struct iovec *iov, size_t niov)
+{
+    while (niov) {
+        int cnt = niov < IOV_MAX ? (int) niov : IOV_MAX;
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        size_t left = (size_t) n;
+        while (niov && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (left) {
+            iov->iov_base = (char*) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+static bool gather_flush(
+    slz_ctx_t *ctx, void *objp, slz_sink_t *sink, size_t need)
+{
+    gather_t *obj = objp;
+    if (!add_buffered(ctx, obj, sink)) {
+        /* The sink is poisoned, emptying the buffer, so drop the list. */
+        obj->niov = 0;
+        obj->mark = sink->buf;
+        return false;
+    }
+    bool ok = writev_all(obj->fd, obj->iov, obj->niov);
+    obj->niov = 0;
+    sink->pos = sink->buf;
+    obj->mark = sink->buf;
+    if (!ok) {
+        obj->saved_errno = errno;
+        return false;
+    }
+
+    if (!slz_sink_try_alloc(ctx, sink, need, GATHER_BUFSIZE))
+        return false;
+    obj->mark = sink->buf;
+    return true;
+}
+
+static slz_sink_funcs_t gather_sink_funcs = {
+    .write = gather_write,
+    .strerror = gather_strerror,
+    .free = gather_free,
+    .flush = gather_flush
+};
+
+void slz_sink_gather_fd(slz_ctx_t *ctx, slz_sink_t *sink, int fd)
+{
+    gather_t *obj = slz_malloc(ctx, sizeof *obj);
+    obj->fd = fd;
+    obj->saved_errno = 0;
+    obj->iov = NULL;
+    obj->niov = obj->iov_cap = 0;
+    obj->mark = NULL;
+    obj->allocator = ctx->allocator;
+    slz_sink_init(ctx, sink, &gather_sink_funcs, obj);
+}
+
+void slz_put_bytes_ref(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t len, const char *data)
+{
+    assert (slz_ok(ctx));
+    assert (!sink->error);
+    if (sink->funcs != &gather_sink_funcs || len < GATHER_MIN_REF) {
+        slz_put_bytes(ctx, sink, len, data);
+        return;
+    }
+    gather_t *obj = sink->obj;
+    if (!add_buffered(ctx, obj, sink) || !add_iov(ctx, obj, data, len))
+        slz_raise(ctx, SLZ_SINK, sink);
+}
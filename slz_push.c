@@ -0,0 +1,199 @@
+/* Push sources: sources whose window the caller fills, as data arrives.
+ *
+ * The window is src->buf, which holds everything pushed from the mark on, and
+ * maybe some from before it, until there's a need for the room. As for any
+ * source, src->offset is the stream offset of src->end, which here is how
+ * much has been pushed in all.
+ */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <string.h>
+
+typedef struct {
+    uint64_t mark;              /* the stream offset to rewind to */
+    size_t need;                /* how many more bytes the last fill wanted */
+    /* The string table attached at the mark (or since), and how full it
+     * was then, so that strings added since can be forgotten on rewinding. */
+    slz_intern_t *intern;
+    size_t intern_entries, intern_bytes;
+    const slz_allocator_t *allocator;
+} push_t;
+
+static void save_intern(push_t *obj, slz_intern_t *intern)
+{
+    obj->intern = intern;
+    if (intern) {
+        obj->intern_entries = intern->nentries;
+        obj->intern_bytes = intern->nbytes;
+    }
+}
+
+/* The stream offset of src->buf. */
+static uint64_t buf_offset(slz_src_t *src) {
+    return src->offset - (uint64_t) (src->end - src->buf);
+}
+
+
+/* Vtable methods. */
+static bool push_read(void *obj, char *buf, size_t buflen)
+{
+    IMPOSSIBLE;                 /* push_fill is used instead */
+    (void) obj; (void) buf; (void) buflen;
+}
+
+static size_t push_strerror(void *obj, char *buf, size_t buflen)
+{
+    (void) obj;
+    return slz_strerror_msg(buf, buflen, "more data needed");
+}
+
+static void push_free(void *objp)
+{
+    push_t *obj = objp;
+    slz_allocator_free(obj->allocator, obj);
+}
+
+static bool push_fill(slz_ctx_t *ctx, void *objp, slz_src_t *src, size_t need)
+{
+    push_t *obj = objp;
+    obj->need = need - (size_t) (src->end - src->pos);
+    ctx->state = SLZ_INCOMPLETE;
+    return false;
+}
+
+/* Anywhere still in the buffer can be gone back to, which is at least as far
+ * as the mark. */
+static bool push_seek(
+    slz_ctx_t *ctx, void *objp, slz_src_t *src, uint64_t offset)
+{
+    push_t *obj = objp;
+    if (offset > src->offset) {
+        obj->need = offset - src->offset;
+        ctx->state = SLZ_INCOMPLETE;
+        return false;
+    }
+    if (offset < buf_offset(src)) {
+        /* Before the mark, so gone. */
+        ctx->state = SLZ_CANT_SEEK;
+        return false;
+    }
+    src->pos = src->end - (src->offset - offset);
+    return true;
+}
+
+static slz_src_funcs_t push_src_funcs = {
+    .read = push_read,
+    .strerror = push_strerror,
+    .free = push_free,
+    .fill = push_fill,
+    .seek = push_seek
+};
+
+
+/* Initializers. */
+static push_t *push_init(slz_ctx_t *ctx, push_t *obj)
+{
+    if (!obj) {
+        obj = slz_malloc(ctx, sizeof *obj);
+        obj->allocator = ctx->allocator;
+    }
+    obj->mark = 0;
+    obj->need = 0;
+    save_intern(obj, NULL);
+    return obj;
+}
+
+void slz_src_push(slz_ctx_t *ctx, slz_src_t *src)
+{
+    slz_src_init(ctx, src, &push_src_funcs, push_init(ctx, NULL));
+}
+
+void slz_src_reset_push(slz_ctx_t *ctx, slz_src_t *src)
+{
+    push_t *obj = src->funcs == &push_src_funcs ? src->obj : NULL;
+    slz_src_reset(ctx, src, &push_src_funcs, push_init(ctx, obj));
+    /* The table stays attached. */
+    save_intern(src->obj, src->intern);
+}
+
+
+/* Pushing. */
+char *slz_src_push_reserve(slz_ctx_t *ctx, slz_src_t *src, size_t len)
+{
+    assert (src->funcs == &push_src_funcs);
+    push_t *obj = src->obj;
+    size_t used = src->end - src->buf;
+    if (src->bufsize - used >= len)
+        return src->buf + used;
+
+    /* Let go of what's before the mark, and grow if that's not enough. */
+    size_t drop = (size_t) (obj->mark - buf_offset(src));
+    size_t keep = used - drop, pos = src->pos - src->buf - drop;
+    if (src->bufsize - keep < len) {
+        size_t size = src->bufsize ? src->bufsize : SLZ_BUFSIZE;
+        while (size - keep < len) {
+            if (size * 2 < size) {
+                ctx->state = SLZ_OOM;
+                slz_raise(ctx, SLZ_SRC, src);
+            }
+            size *= 2;
+        }
+        char *buf = slz_malloc(ctx, size);
+        if (keep)
+            memcpy(buf, src->buf + drop, keep);
+        slz_free(ctx, src->buf);
+        src->buf = buf;
+        src->bufsize = size;
+    }
+    else if (keep)
+        memmove(src->buf, src->buf + drop, keep);
+    src->pos = src->buf + pos;
+    src->end = src->buf + keep;
+    return src->buf + keep;
+}
+
+void slz_src_push_commit(slz_src_t *src, size_t n)
+{
+    assert (n <= src->bufsize - (size_t) (src->end - src->buf));
+    src->end += n;
+    src->offset += n;
+}
+
+void slz_src_push_bytes(
+    slz_ctx_t *ctx, slz_src_t *src, size_t len, const char *data)
+{
+    char *p = slz_src_push_reserve(ctx, src, len);
+    if (len)
+        memcpy(p, data, len);
+    slz_src_push_commit(src, len);
+}
+
+void slz_src_push_mark(slz_src_t *src)
+{
+    push_t *obj = src->obj;
+    obj->mark = slz_src_tell(src);
+    save_intern(obj, src->intern);
+}
+
+void slz_src_push_intern_changed(slz_src_t *src)
+{
+    if (src->funcs == &push_src_funcs)
+        save_intern(src->obj, src->intern);
+}
+
+size_t slz_src_push_rewind(slz_src_t *src)
+{
+    push_t *obj = src->obj;
+    src->pos = src->end - (src->offset - obj->mark);
+    src->error = false;
+    /* The strings will be read again, and mustn't get a second id. */
+    if (obj->intern && obj->intern == src->intern) {
+        obj->intern->nentries = obj->intern_entries;
+        obj->intern->nbytes = obj->intern_bytes;
+    }
+    size_t need = obj->need;
+    obj->need = 0;
+    return need;
+}
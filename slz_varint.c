@@ -0,0 +1,242 @@
+/* Variable-length integers.
+ *
+ * Single values are LEB128: seven bits per byte, least significant first, the
+ * top bit set on every byte but the last. Signed values are zigzag-encoded
+ * first, so that small negative numbers stay short.
+ *
+ * Arrays of 32-bit values use the "stream VByte" layout instead, which is much
+ * faster to decode: values are grouped in fours, each group described by a
+ * control byte holding four 2-bit lengths (1 to 4 bytes, minus one; the first
+ * value in the low bits). The control bytes come first, then the values'
+ * bytes, little-endian. To bound how much must be buffered, arrays are
+ * written in blocks of SVB_BLOCK values, each laid out that way.
+ */
+
+#include "slz.h"
+#include "slz_internal.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define SVB_BLOCK 1024
+#define SVB_CTRL_LEN(n) (((n) + 3) / 4)
+
+
+/* Single values. */
+uint64_t slz_PRIVATE_get_varuint(slz_ctx_t *ctx, slz_src_t *src)
+{
+    uint64_t val = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        uint8_t byte = slz_get_uint8(ctx, src);
+        /* The tenth byte holds only the top bit. */
+        if (shift == 63 && byte > 1) {
+            ctx->state = SLZ_MALFORMED;
+            slz_raise(ctx, SLZ_SRC, src);
+        }
+        val |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return val;
+    }
+}
+
+uint64_t slz_PRIVATE_try_get_varuint(slz_ctx_t *ctx, slz_src_t *src)
+{
+    uint64_t val = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        if (!slz_src_try_reserve(ctx, src, 1))
+            return 0;
+        uint8_t byte = slz_get_uint8_unchecked(src);
+        if (shift == 63 && byte > 1) {
+            ctx->state = SLZ_MALFORMED;
+            ctx->origin_type = SLZ_SRC;
+            ctx->origin.src = src;
+            slz_src_poison(ctx, src);
+            return 0;
+        }
+        val |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return val;
+    }
+}
+
+
+/* Stream VByte encoding. */
+static unsigned svb_len(uint32_t v) {
+    return v < (1u << 8) ? 1 : v < (1u << 16) ? 2 : v < (1u << 24) ? 3 : 4;
+}
+
+/* Encodes `n' <= SVB_BLOCK values into `out', which must have room for
+ * SVB_CTRL_LEN(n) + 4n bytes. Returns how many bytes it used. */
+static size_t svb_encode(char *out, const uint32_t *vals, size_t n)
+{
+    unsigned char *ctrl = (unsigned char*) out;
+    unsigned char *data = ctrl + SVB_CTRL_LEN(n);
+    memset(ctrl, 0, SVB_CTRL_LEN(n));
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t v = vals[i];
+        unsigned len = svb_len(v);
+        ctrl[i / 4] |= (unsigned char) ((len - 1) << (2 * (i % 4)));
+        for (unsigned b = 0; b < len; ++b)
+            *data++ = (unsigned char) (v >> (8 * b));
+    }
+    return (char*) data - out;
+}
+
+/* Length of the data described by the control bytes of `n' values. */
+static size_t svb_data_len(const unsigned char *ctrl, size_t n)
+{
+    size_t len = n;
+    for (size_t i = 0; i < n / 4; ++i)
+        len += (ctrl[i] & 3) + ((ctrl[i] >> 2) & 3) +
+            ((ctrl[i] >> 4) & 3) + (ctrl[i] >> 6);
+    for (size_t i = n / 4 * 4; i < n; ++i)
+        len += (ctrl[i / 4] >> (2 * (i % 4))) & 3;
+    return len;
+}
+
+/* Decodes values [from, n) of a block whose data for value `from' starts at
+ * `data'. */
+static void svb_decode_scalar(uint32_t *out, const unsigned char *ctrl,
+                              const unsigned char *data, size_t from, size_t n)
+{
+    for (size_t i = from; i < n; ++i) {
+        unsigned len = ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        uint32_t v = 0;
+        for (unsigned b = 0; b < len; ++b)
+            v |= (uint32_t) data[b] << (8 * b);
+        data += len;
+        out[i] = v;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* For each control byte: the pshufb mask spreading its group's data bytes
+ * over four 32-bit lanes, and the group's total data length. */
+static char svb_masks[256][16];
+static unsigned char svb_group_len[256];
+
+__attribute__((constructor))
+static void svb_init_tables(void)
+{
+    for (unsigned c = 0; c < 256; ++c) {
+        unsigned offset = 0;
+        for (unsigned i = 0; i < 4; ++i) {
+            unsigned len = ((c >> (2 * i)) & 3) + 1;
+            for (unsigned b = 0; b < 4; ++b)
+                svb_masks[c][4 * i + b] = b < len ? (char) (offset + b) : -1;
+            offset += len;
+        }
+        svb_group_len[c] = (unsigned char) offset;
+    }
+}
+
+/* Decodes whole groups while a 16-byte load can't run off the end of the
+ * data; returns how many values it decoded, and advances *datap past them. */
+__attribute__((target("ssse3")))
+static size_t svb_decode_ssse3(uint32_t *out, const unsigned char *ctrl,
+                               const unsigned char **datap,
+                               const unsigned char *data_end, size_t n)
+{
+    const unsigned char *data = *datap;
+    size_t i = 0;
+    for (; i + 4 <= n && data_end - data >= 16; i += 4) {
+        unsigned c = ctrl[i / 4];
+        __m128i v = _mm_loadu_si128((const __m128i*) data);
+        __m128i m = _mm_loadu_si128((const __m128i*) svb_masks[c]);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_shuffle_epi8(v, m));
+        data += svb_group_len[c];
+    }
+    *datap = data;
+    return i;
+}
+
+static bool have_ssse3;
+
+__attribute__((constructor))
+static void pick_kernels(void)
+{
+    __builtin_cpu_init();
+    have_ssse3 = __builtin_cpu_supports("ssse3");
+}
+#endif
+
+static void svb_decode(uint32_t *out, const unsigned char *ctrl,
+                       const unsigned char *data, size_t data_len, size_t n)
+{
+    size_t done = 0;
+#ifdef HAVE_X86_SIMD
+    if (have_ssse3)
+        done = svb_decode_ssse3(out, ctrl, &data, data + data_len, n);
+#else
+    (void) data_len;
+#endif
+    svb_decode_scalar(out, ctrl, data, done, n);
+}
+
+
+/* Putting & getting arrays. */
+static uint32_t zigzag32(int32_t v) {
+    return ((uint32_t) v << 1) ^ -((uint32_t) v >> 31);
+}
+
+static int32_t unzigzag32(uint32_t v) {
+    return (int32_t) ((v >> 1) ^ -(v & 1));
+}
+
+void slz_put_varuint32_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const uint32_t *vals)
+{
+    while (n) {
+        size_t k = n < SVB_BLOCK ? n : SVB_BLOCK;
+        char *p = slz_sink_reserve(ctx, sink, SVB_CTRL_LEN(k) + 4 * k);
+        sink->pos += svb_encode(p, vals, k);
+        vals += k;
+        n -= k;
+    }
+}
+
+void slz_put_varint32_array(
+    slz_ctx_t *ctx, slz_sink_t *sink, size_t n, const int32_t *vals)
+{
+    uint32_t block[SVB_BLOCK];
+    while (n) {
+        size_t k = n < SVB_BLOCK ? n : SVB_BLOCK;
+        for (size_t i = 0; i < k; ++i)
+            block[i] = zigzag32(vals[i]);
+        slz_put_varuint32_array(ctx, sink, k, block);
+        vals += k;
+        n -= k;
+    }
+}
+
+void slz_get_varuint32_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, uint32_t *out)
+{
+    while (n) {
+        size_t k = n < SVB_BLOCK ? n : SVB_BLOCK;
+        size_t ctrl_len = SVB_CTRL_LEN(k);
+        const unsigned char *ctrl =
+            (const unsigned char*) slz_src_peek(ctx, src, ctrl_len);
+        size_t data_len = svb_data_len(ctrl, k);
+        /* Peeking may move the window, so find the control bytes again. */
+        ctrl = (const unsigned char*)
+            slz_src_peek(ctx, src, ctrl_len + data_len);
+        svb_decode(out, ctrl, ctrl + ctrl_len, data_len, k);
+        src->pos += ctrl_len + data_len;
+        out += k;
+        n -= k;
+    }
+}
+
+void slz_get_varint32_array(
+    slz_ctx_t *ctx, slz_src_t *src, size_t n, int32_t *out)
+{
+    /* Decode in place, then undo the zigzag. */
+    slz_get_varuint32_array(ctx, src, n, (uint32_t*) out);
+    for (size_t i = 0; i < n; ++i)
+        out[i] = unzigzag32((uint32_t) out[i]);
+}
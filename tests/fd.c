@@ -0,0 +1,61 @@
+/* fd sources that start at an unaligned offset.
+ *
+ * With SLZ_FD_DIRECT, reads start at the block before the fd's offset, and
+ * the bytes before it are skipped; a first fill of a whole number of blocks
+ * must still leave room for them. (Where O_DIRECT isn't supported, this
+ * tests the plain path instead.)
+ */
+
+/* For mkstemp. */
+#define _POSIX_C_SOURCE 200809L
+
+#include <slz.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE (4 << 20)
+#define START 100
+#define NEED (256 * 1024)
+
+int main(int argc, char **argv)
+{
+    (void) argc;
+    char *progname = argv[0];
+
+    /* In the build tree rather than /tmp, which is often tmpfs, and
+     * doesn't do O_DIRECT. */
+    char path[] = "tests/fd-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+
+    char *data = malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; ++i)
+        data[i] = (char) (i * 7 + i / 251);
+    if (write(fd, data, FILE_SIZE) != FILE_SIZE ||
+        lseek(fd, START, SEEK_SET) != START) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    slz_ctx_t ctx;
+    slz_init_with_perror(&ctx, progname);
+    slz_src_t src;
+    slz_src_from_fd(&ctx, &src, fd, SLZ_FD_DIRECT);
+    const char *p = slz_src_peek(&ctx, &src, NEED);
+    if (memcmp(p, data + START, NEED)) {
+        fprintf(stderr, "%s: wrong data after an unaligned start\n",
+                progname);
+        exit(EXIT_FAILURE);
+    }
+
+    slz_src_destroy(&ctx, &src);
+    close(fd);
+    free(data);
+    return 0;
+}
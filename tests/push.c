@@ -0,0 +1,85 @@
+/* Push sources with a string table attached.
+ *
+ * Strings that a message adds to the table are read again after a rewind,
+ * and must not be added twice, or every later id is off. So the stream is
+ * pushed in two pieces, split at every point in turn, and each time must
+ * decode as it was written.
+ */
+
+#include <slz.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const strs[] = { "alpha", "beta", "beta", "gamma", "alpha" };
+#define NSTRS (sizeof strs / sizeof *strs)
+
+static char *progname;
+
+/* Gets the message, all of `strs', or returns false if it's incomplete. */
+static bool get_message(slz_ctx_t *ctx, slz_src_t *src, const char **out)
+{
+    if (slz_catch(ctx)) {
+        if (ctx->state != SLZ_INCOMPLETE) {
+            slz_perror(ctx, progname);
+            exit(EXIT_FAILURE);
+        }
+        slz_clear_error(ctx);
+        return false;
+    }
+    for (size_t i = 0; i < NSTRS; ++i)
+        out[i] = slz_get_str_interned(ctx, src, NULL, NULL);
+    slz_end_catch(ctx);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc;
+    progname = argv[0];
+
+    slz_ctx_t ctx;
+    slz_init_with_perror(&ctx, progname);
+
+    slz_intern_t intern;
+    slz_intern_init(&intern, 0, 0);
+    slz_sink_t sink;
+    slz_sink_to_memory(&ctx, &sink);
+    slz_sink_set_intern(&sink, &intern);
+    for (size_t i = 0; i < NSTRS; ++i)
+        slz_put_str_interned(&ctx, &sink, strs[i]);
+    size_t len;
+    char *data = slz_sink_memory_release(&ctx, &sink, &len);
+    slz_sink_destroy(&ctx, &sink);
+    slz_intern_free(&intern);
+
+    for (size_t split = 1; split < len; ++split) {
+        slz_src_t src;
+        slz_src_push(&ctx, &src);
+        slz_src_set_intern(&src, &intern);
+        const char *got[NSTRS];
+
+        slz_src_push_bytes(&ctx, &src, split, data);
+        if (!get_message(&ctx, &src, got)) {
+            slz_src_push_rewind(&src);
+            slz_src_push_bytes(&ctx, &src, len - split, data + split);
+            if (!get_message(&ctx, &src, got)) {
+                fprintf(stderr, "%s: still incomplete\n", progname);
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (size_t i = 0; i < NSTRS; ++i) {
+            if (strcmp(got[i], strs[i])) {
+                fprintf(stderr, "%s: split at %zu: got %s for %s\n",
+                        progname, split, got[i], strs[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        slz_src_destroy(&ctx, &src);
+        slz_intern_free(&intern);
+    }
+
+    free(data);
+    return 0;
+}